@@ -13,9 +13,16 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
+#ifndef LINUXCOMPAT_HEADLESS
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
+#include <glib-unix.h>
+#endif
 
 #include "bline.h"
 #include "linuxcompat.h"
@@ -152,6 +159,7 @@ const unsigned char font8x8_bits[] = {
    0x00, 0x00, 0x00, 0x00 };
 #endif
 
+#ifndef LINUXCOMPAT_HEADLESS
 static GtkWidget *vbox, *window, *drawing_area;
 #define SCALE_FACTOR 6
 #define GTK_SCREEN_WIDTH (SCREEN_XDIM * SCALE_FACTOR)
@@ -162,12 +170,17 @@ static GdkGC *gc = NULL;               /* our graphics context. */
 static int screen_offset_x = 0;
 static int screen_offset_y = 0;
 static gint timer_tag;
+static int timer_interval_ms;
+static int badge_waiting_for_input = 0; /* see wait_for_input(), only used on the GTK thread */
 #define NCOLORS 8 
 GdkColor huex[NCOLORS];
+static unsigned char huex_rgb[NCOLORS][3];
+static unsigned char *rgb_buffer = NULL; /* live_screen_color, scaled up and converted to RGB */
+static int pixel_width = SCALE_FACTOR;
+static int pixel_height = SCALE_FACTOR;
 static int (*badge_function)(void);
 static int time_to_quit = 0;
-
-static unsigned char current_color = BLUE;
+#endif
 
 #define BUTTON 0
 #define LEFT 1
@@ -175,63 +188,453 @@ static unsigned char current_color = BLUE;
 #define UP 3
 #define DOWN 4
 
+/* Presses of each button not yet consumed by the badge code.  Only the thread
+ * running the badge code touches these, everyone else queues an input event.
+ */
 static int button_pressed[5] = { 0 };
 
+/* Input events, in a ring per producer: key_press_cb() on the GTK thread, and
+ * the IR transport thread for each badge's packets.  Each ring has one writer
+ * and one reader, so no locks are needed: the writer only moves tail, the
+ * reader only moves head.
+ */
+#define INPUT_RING_SIZE 4096 /* power of 2 */
+struct input_ring {
+	unsigned int event[INPUT_RING_SIZE]; /* a button, or an IR packet */
+	unsigned int head, tail;
+};
+static struct input_ring key_ring;
+
+/* Returns 0 if the ring is full */
+static int input_ring_put(struct input_ring *r, unsigned int event)
+{
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == INPUT_RING_SIZE)
+		return 0;
+	r->event[tail & (INPUT_RING_SIZE - 1)] = event;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Returns 0 if the ring is empty */
+static int input_ring_get(struct input_ring *r, unsigned int *event)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return 0;
+	*event = r->event[head & (INPUT_RING_SIZE - 1)];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int profiling = 0; /* see profile_enable() */
+
+/* Latencies in microseconds, bucketed the way HdrHistogram does it: 16 buckets
+ * for each power of 2, so any value is known to within 1/16th of itself, over
+ * the whole range, in a few KB.
+ */
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS ((64 - 3) * LATENCY_SUB_BUCKETS)
+struct latency_histogram {
+	unsigned long bucket[LATENCY_BUCKETS];
+	unsigned long count;
+	unsigned long long max_us;
+};
+
+static int latency_bucket(unsigned long long us)
+{
+	int e;
+
+	if (us < LATENCY_SUB_BUCKETS)
+		return us;
+	e = 63 - __builtin_clzll(us); /* at least 4 */
+	return (e - 3) * LATENCY_SUB_BUCKETS + ((us >> (e - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* The highest value that lands in bucket i */
+static unsigned long long latency_bucket_top(int i)
+{
+	int e = i / LATENCY_SUB_BUCKETS + 3;
+
+	if (i < LATENCY_SUB_BUCKETS)
+		return i;
+	return ((unsigned long long) (LATENCY_SUB_BUCKETS + i % LATENCY_SUB_BUCKETS + 1) << (e - 4)) - 1;
+}
+
+static void latency_record(struct latency_histogram *h, unsigned long long start_ns)
+{
+	unsigned long long us = (profile_now_ns() - start_ns) / 1000;
+
+	h->bucket[latency_bucket(us)]++;
+	h->count++;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+static unsigned long long latency_percentile(struct latency_histogram *h, double percent)
+{
+	unsigned long want = (unsigned long) (h->count * percent / 100.0 + 0.5), seen = 0;
+	int i;
+
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == LATENCY_BUCKETS || latency_bucket_top(i) > h->max_us)
+		return h->max_us;
+	return latency_bucket_top(i);
+}
+
+/* From a key being pressed until the first frame after the badge code saw it
+ * is swapped in, and until that frame is painted.  Only the GTK thread, which
+ * both takes the keys and runs the badge code, touches these.
+ */
+static struct latency_histogram key_to_swap_latency, key_to_paint_latency;
+
+/* Inclusive bounding box of changed pixels, empty when x1 > x2 */
+struct fb_rect {
+	int x1, y1, x2, y2;
+};
+#define FB_RECT_EMPTY { SCREEN_XDIM, SCREEN_YDIM, -1, -1 }
+
+static void fb_rect_add(struct fb_rect *r, int x1, int y1, int x2, int y2)
+{
+	if (x1 < r->x1)
+		r->x1 = x1;
+	if (y1 < r->y1)
+		r->y1 = y1;
+	if (x2 > r->x2)
+		r->x2 = x2;
+	if (y2 > r->y2)
+		r->y2 = y2;
+}
+
+static void fb_rect_clear(struct fb_rect *r)
+{
+	static const struct fb_rect empty = FB_RECT_EMPTY;
+
+	*r = empty;
+}
+
+/* A small cache of whole screen images, keyed by a number of the caller's
+ * choosing, for things that get drawn over and over (e.g. maze corridors).
+ * Direct mapped: a new image simply replaces whatever was in its slot.
+ */
+#define FB_CACHE_SLOTS 64
+struct fb_cache_entry {
+	unsigned int key;
+	int valid;
+	unsigned char screen[SCREEN_YDIM][SCREEN_XDIM];
+};
+
+/* Everything the Fb*() functions draw on.  Each thread gets its own, made the
+ * first time it draws, so games stepped on different threads don't scribble
+ * over each other.
+ */
+struct framebuffer {
+	unsigned char current_color;
+	/* Row major, so horizontal spans are contiguous */
+	unsigned char screen_color[SCREEN_YDIM][SCREEN_XDIM];
+	unsigned char live_screen_color[SCREEN_YDIM][SCREEN_XDIM];
+	struct fb_rect dirty;  /* screen_color written since last FbSwapBuffers() */
+	struct fb_rect damage; /* live_screen_color changed since last redraw was queued */
+	unsigned int frame_generation; /* bumped by every FbSwapBuffers() */
+	/* When profiling, when the oldest key not yet answered was pressed, by how
+	 * far the answer has got: pressed, seen by the badge code, frame swapped in,
+	 * redraw queued by advance_game().  0 for none.
+	 */
+	unsigned long long key_ns, key_seen_ns, key_swapped_ns, key_queued_ns;
+	unsigned char write_x, write_y;
+	struct fb_cache_entry cache[FB_CACHE_SLOTS];
+};
+
+static __thread struct framebuffer *fb = NULL;
+static pthread_key_t fb_key;
+static pthread_once_t fb_key_once = PTHREAD_ONCE_INIT;
+
+static void fb_make_key(void)
+{
+	pthread_key_create(&fb_key, free); /* frees a thread's framebuffer when it exits */
+}
+
+static struct framebuffer *fb_this_thread(void)
+{
+	if (fb)
+		return fb;
+	fb = calloc(1, sizeof(*fb));
+	if (!fb) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	fb->current_color = BLUE;
+	fb_rect_clear(&fb->dirty);
+	fb_rect_clear(&fb->damage);
+	pthread_once(&fb_key_once, fb_make_key);
+	pthread_setspecific(fb_key, fb);
+	return fb;
+}
+
 void FbColor(int color)
 {
-    current_color = (unsigned char) (color % 8);
+    fb_this_thread()->current_color = (unsigned char) (color % 8);
 }
 
 void FbInit(void)
 {
+    fb_this_thread();
 }
 
-static unsigned char screen_color[SCREEN_XDIM][SCREEN_YDIM];
-static unsigned char live_screen_color[SCREEN_XDIM][SCREEN_YDIM];
-
 void plot_point(int x, int y, void *context)
 {
     unsigned char *screen_color = context;
+    struct framebuffer *f = fb_this_thread();
 
-    screen_color[x * SCREEN_YDIM + y] = current_color;
+    if (x < 0 || x >= SCREEN_XDIM || y < 0 || y >= SCREEN_YDIM)
+        return;
+    screen_color[y * SCREEN_XDIM + x] = f->current_color;
+    fb_rect_add(&f->dirty, x, y, x, y);
 }
 
-void clear_point(int x, int y, void *context)
+/* Only the part of screen_color written since the last swap can differ from
+ * live_screen_color, so only that part is copied, and only that part needs
+ * to be redrawn.
+ */
+void FbSwapBuffers(void)
 {
-    unsigned char *screen_color = context;
+	int y;
+	struct framebuffer *f = fb_this_thread();
+
+	if (f->dirty.x1 < 0)
+		f->dirty.x1 = 0;
+	if (f->dirty.y1 < 0)
+		f->dirty.y1 = 0;
+	if (f->dirty.x2 > SCREEN_XDIM - 1)
+		f->dirty.x2 = SCREEN_XDIM - 1;
+	if (f->dirty.y2 > SCREEN_YDIM - 1)
+		f->dirty.y2 = SCREEN_YDIM - 1;
+	if (f->dirty.x1 > f->dirty.x2 || f->dirty.y1 > f->dirty.y2)
+		goto out;
+
+	if (f->dirty.x1 == 0 && f->dirty.x2 == SCREEN_XDIM - 1)
+		memcpy(f->live_screen_color[f->dirty.y1], f->screen_color[f->dirty.y1],
+			(f->dirty.y2 - f->dirty.y1 + 1) * SCREEN_XDIM);
+	else
+		for (y = f->dirty.y1; y <= f->dirty.y2; y++)
+			memcpy(&f->live_screen_color[y][f->dirty.x1], &f->screen_color[y][f->dirty.x1],
+				f->dirty.x2 - f->dirty.x1 + 1);
+	fb_rect_add(&f->damage, f->dirty.x1, f->dirty.y1, f->dirty.x2, f->dirty.y2);
+out:
+	fb_rect_clear(&f->dirty);
+	f->frame_generation++;
+	if (f->key_seen_ns) {
+		latency_record(&key_to_swap_latency, f->key_seen_ns);
+		if (!f->key_swapped_ns)
+			f->key_swapped_ns = f->key_seen_ns;
+		f->key_seen_ns = 0;
+	}
+}
 
-    screen_color[x * SCREEN_YDIM + y] = BLACK;
+/* Same Bresenham as bline(), but specialized to write straight into
+ * screen_color instead of calling a plotting_function for every pixel.
+ * The caller must make sure the line is entirely on the screen.
+ */
+static void fb_line(int x1, int y1, int x2, int y2)
+{
+    int dx, dy, i, e, inc1, inc2, major, minor, n;
+    unsigned char *p;
+    struct framebuffer *f = fb_this_thread();
+    const unsigned char color = f->current_color;
+
+    dx = x2 - x1;
+    if (dx < 0)
+        dx = -dx;
+    dy = y2 - y1;
+    if (dy < 0)
+        dy = -dy;
+
+    if (dx > dy) {
+        major = (x2 < x1) ? -1 : 1;
+        minor = (y2 < y1) ? -SCREEN_XDIM : SCREEN_XDIM;
+        n = dx;
+        e = 2 * dy - dx;
+        inc1 = 2 * (dy - dx);
+        inc2 = 2 * dy;
+    } else {
+        major = (y2 < y1) ? -SCREEN_XDIM : SCREEN_XDIM;
+        minor = (x2 < x1) ? -1 : 1;
+        n = dy;
+        e = 2 * dx - dy;
+        inc1 = 2 * (dx - dy);
+        inc2 = 2 * dx;
+    }
+
+    p = &f->screen_color[y1][x1];
+    *p = color;
+    for (i = 0; i < n; i++) {
+        if (e >= 0) {
+            p += minor;
+            e += inc1;
+        } else {
+            e += inc2;
+        }
+        p += major;
+        *p = color;
+    }
 }
 
-void FbSwapBuffers(void)
+/* Cohen-Sutherland outcodes */
+#define CLIP_LEFT 1
+#define CLIP_RIGHT 2
+#define CLIP_TOP 4
+#define CLIP_BOTTOM 8
+
+static int clip_outcode(int x, int y)
 {
-	memcpy(live_screen_color, screen_color, sizeof(live_screen_color));
+    int code = 0;
+
+    if (x < 0)
+        code |= CLIP_LEFT;
+    else if (x >= SCREEN_XDIM)
+        code |= CLIP_RIGHT;
+    if (y < 0)
+        code |= CLIP_TOP;
+    else if (y >= SCREEN_YDIM)
+        code |= CLIP_BOTTOM;
+    return code;
 }
 
-void FbLine(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2)
+/* n / d, rounded to the nearest integer */
+static int clip_divide(int n, int d)
 {
-    bline(x1, y1, x2, y2, plot_point, screen_color);
+    if (d < 0) {
+        n = -n;
+        d = -d;
+    }
+    if (n >= 0)
+        return (n + d / 2) / d;
+    return -((-n + d / 2) / d);
+}
+
+/* Trims the line to the screen.  Returns 0 if none of it is on the screen. */
+static int clip_line(int *x1, int *y1, int *x2, int *y2)
+{
+    int code1, code2, code, x, y;
+
+    code1 = clip_outcode(*x1, *y1);
+    code2 = clip_outcode(*x2, *y2);
+    while (code1 | code2) {
+        if (code1 & code2)
+            return 0;
+        code = code1 ? code1 : code2;
+        if (code & CLIP_TOP) {
+            y = 0;
+            x = *x1 + clip_divide((*x2 - *x1) * (y - *y1), *y2 - *y1);
+        } else if (code & CLIP_BOTTOM) {
+            y = SCREEN_YDIM - 1;
+            x = *x1 + clip_divide((*x2 - *x1) * (y - *y1), *y2 - *y1);
+        } else if (code & CLIP_LEFT) {
+            x = 0;
+            y = *y1 + clip_divide((*y2 - *y1) * (x - *x1), *x2 - *x1);
+        } else {
+            x = SCREEN_XDIM - 1;
+            y = *y1 + clip_divide((*y2 - *y1) * (x - *x1), *x2 - *x1);
+        }
+        if (code == code1) {
+            *x1 = x;
+            *y1 = y;
+            code1 = clip_outcode(x, y);
+        } else {
+            *x2 = x;
+            *y2 = y;
+            code2 = clip_outcode(x, y);
+        }
+    }
+    return 1;
 }
 
-void FbHorizontalLine(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2)
+void FbLine(int x1, int y1, int x2, int y2)
 {
-    unsigned char x;
+    struct framebuffer *f = fb_this_thread();
 
-    for (x = x1; x <= x2; x++)
-        plot_point(x, y1, screen_color);
+    if (!clip_line(&x1, &y1, &x2, &y2))
+        return;
+    fb_line(x1, y1, x2, y2);
+    fb_rect_add(&f->dirty, x1 < x2 ? x1 : x2, y1 < y2 ? y1 : y2, x1 > x2 ? x1 : x2, y1 > y2 ? y1 : y2);
 }
 
-void FbVerticalLine(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2)
+void FbHorizontalLine(int x1, int y1, int x2, __attribute__((unused)) int y2)
 {
-    unsigned char y;
+    struct framebuffer *f = fb_this_thread();
+
+    if (y1 < 0 || y1 >= SCREEN_YDIM)
+        return;
+    if (x1 < 0)
+        x1 = 0;
+    if (x2 >= SCREEN_XDIM)
+        x2 = SCREEN_XDIM - 1;
+    if (x1 > x2)
+        return;
+    memset(&f->screen_color[y1][x1], f->current_color, x2 - x1 + 1);
+    fb_rect_add(&f->dirty, x1, y1, x2, y1);
+}
 
+void FbVerticalLine(int x1, int y1, __attribute__((unused)) int x2, int y2)
+{
+    int y;
+    struct framebuffer *f = fb_this_thread();
+
+    if (x1 < 0 || x1 >= SCREEN_XDIM)
+        return;
+    if (y1 < 0)
+        y1 = 0;
+    if (y2 >= SCREEN_YDIM)
+        y2 = SCREEN_YDIM - 1;
+    if (y1 > y2)
+        return;
     for (y = y1; y <= y2; y++)
-        plot_point(x1, y, screen_color);
+        f->screen_color[y][x1] = f->current_color;
+    fb_rect_add(&f->dirty, x1, y1, x1, y2);
 }
 
 void FbClear(void)
 {
-    memset(screen_color, BLACK, SCREEN_XDIM * SCREEN_YDIM);
+    struct framebuffer *f = fb_this_thread();
+
+    memset(f->screen_color, BLACK, SCREEN_XDIM * SCREEN_YDIM);
+    fb_rect_add(&f->dirty, 0, 0, SCREEN_XDIM - 1, SCREEN_YDIM - 1);
+}
+
+static struct fb_cache_entry *fb_cache_slot(unsigned int key)
+{
+	return &fb_this_thread()->cache[(key * 2654435761u) >> 26]; /* Fibonacci hash, top 6 bits */
+}
+
+void FbCacheStore(unsigned int key)
+{
+	struct fb_cache_entry *e = fb_cache_slot(key);
+	struct framebuffer *f = fb_this_thread();
+
+	memcpy(e->screen, f->screen_color, sizeof(f->screen_color));
+	e->key = key;
+	e->valid = 1;
+}
+
+/* Returns 1 and replaces the whole screen if an image for key is cached, 0 otherwise */
+int FbCacheRestore(unsigned int key)
+{
+	struct fb_cache_entry *e = fb_cache_slot(key);
+	struct framebuffer *f = fb_this_thread();
+
+	if (!e->valid || e->key != key)
+		return 0;
+	memcpy(f->screen_color, e->screen, sizeof(f->screen_color));
+	fb_rect_add(&f->dirty, 0, 0, SCREEN_XDIM - 1, SCREEN_YDIM - 1);
+	return 1;
 }
 
 unsigned char char_to_index(unsigned char charin){
@@ -286,51 +689,51 @@ unsigned char char_to_index(unsigned char charin){
 static void draw_character(unsigned char x, unsigned char y, unsigned char c)
 {
 	unsigned char index = char_to_index(c);
-	unsigned char i, j, bits;
-	unsigned char sx, sy;
+	unsigned char i, j, bits, w, h;
+	unsigned char *row;
+	struct framebuffer *f = fb_this_thread();
+
+	/* Clip the glyph to the screen once, rather than per pixel */
+	if (x >= SCREEN_XDIM || y >= SCREEN_YDIM)
+		return;
+	w = SCREEN_XDIM - x < 8 ? SCREEN_XDIM - x : 8;
+	h = SCREEN_YDIM - y < 8 ? SCREEN_YDIM - y : 8;
 
-	sy = y;
-	for (i = 0; i < 8; i++) {
+	for (i = 0; i < h; i++) {
 #if USE_2016_BADGE_FONT
 		bits = font_2_bits[8 * index + i];
 #endif
 #if USE_2019_BADGE_FONT
 		bits = font8x8_bits[8 * index + i];
 #endif
-		sx = x;
-		for (j = 0; j < 8; j++) {
-			if ((bits >> j) & 0x01) {
-				plot_point(sx, sy, screen_color);
-			} else {
-				clear_point(sx, sy, screen_color);
-			}
-			sx++;
-		}
-		sy++;
+		row = &f->screen_color[y + i][x];
+		for (j = 0; j < w; j++)
+			row[j] = ((bits >> j) & 0x01) ? f->current_color : BLACK;
 	}
+	fb_rect_add(&f->dirty, x, y, x + w - 1, y + h - 1);
 }
 
-static unsigned char write_x = 0;
-static unsigned char write_y = 0;
-
 void FbMove(unsigned char x, unsigned char y)
 {
-	write_x = x;
-	write_y = y;
+	struct framebuffer *f = fb_this_thread();
+
+	f->write_x = x;
+	f->write_y = y;
 }
 
 void FbWriteLine(char *s)
 {
 	int i;
+	struct framebuffer *f = fb_this_thread();
 
 	for (i = 0; s[i]; i++) {
-		draw_character(write_x, write_y, s[i]);
-		write_x += 8;
-		if (write_x > SCREEN_XDIM - 8) {
-			write_x = 0;
-			write_y += 8;
-			if (write_y > SCREEN_YDIM - 8)
-				write_y = 0;
+		draw_character(f->write_x, f->write_y, s[i]);
+		f->write_x += 8;
+		if (f->write_x > SCREEN_XDIM - 8) {
+			f->write_x = 0;
+			f->write_y += 8;
+			if (f->write_y > SCREEN_YDIM - 8)
+				f->write_y = 0;
 		}
 	}
 }
@@ -354,94 +757,379 @@ static void ir_packet_ignore(struct IRpacket_t packet)
 {
 }
 
-static void (*ir_packet_callback)(struct IRpacket_t) = ir_packet_ignore;
+/* A simulated badge's IR port.  Packets for it come from other badges in the
+ * room, or from outside through its fifo, if it has one.  They are all moved by
+ * one transport thread, so each ring still has exactly one writer and one
+ * reader: send is filled by the badge and emptied by the transport thread,
+ * receive the other way around.
+ */
+struct ir_badge {
+	unsigned int id;
+	int fd; /* the fifo, or -1 */
+	int partial; /* bytes of a packet split across fifo reads, in receive's tail slot */
+	int stalled; /* receive is full, the fifo isn't being read */
+	int received; /* receive got packets since the badge was last woken */
+	int joined; /* in ir_badge[] */
+	void (*wake)(void *cookie);
+	void *cookie;
+	void (*callback)(struct IRpacket_t);
+	unsigned int send_rate; /* packets per second, 0 for no limit, only changed atomically */
+	uint64_t send_credit, send_credit_time; /* ns of sending time saved up, and when */
+	/* Counters, each only changed by one thread, read atomically by any */
+	unsigned long sent, coalesced, dropped, lost;
+	struct input_ring send, receive;
+};
+
+static void wake_badge(void);
+
+static void ir_wake_gtk(__attribute__((unused)) void *cookie)
+{
+	wake_badge();
+}
 
+/* The badge run by start_gtk() */
+static struct ir_badge ir_default_badge = {
+	.id = 0x0100,
+	.fd = -1,
+	.wake = ir_wake_gtk,
+	.callback = ir_packet_ignore,
+};
+
+/* The badge the calling thread is running, see ir_badge_select() */
+static __thread struct ir_badge *ir_this_badge;
+
+static struct ir_badge *ir_current(void)
+{
+	return ir_this_badge ? ir_this_badge : &ir_default_badge;
+}
+
+/* Everyone in the room.  Badges are only ever added, so the transport thread
+ * can walk this without a lock.
+ */
+#define IR_MAX_BADGES 1024
+static struct ir_badge *ir_badge[IR_MAX_BADGES];
+static int ir_nbadges = 0; /* only changed atomically */
+static pthread_mutex_t ir_badge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ir_epoll_fd = -1;
+static int ir_kick_fd = -1; /* eventfd: some badge's send ring has packets */
+static int ir_kick_pending = 0; /* only changed atomically */
+static int ir_nstalled = 0; /* only touched by the transport thread */
+static int ir_nthrottled = 0; /* badges with packets held back by their send rate, ditto */
+static pthread_once_t ir_transport_once = PTHREAD_ONCE_INIT;
 
 void register_ir_packet_callback(void (*callback)(struct IRpacket_t))
 {
-	ir_packet_callback = callback;
+	ir_current()->callback = callback;
 }
 
 void unregister_ir_packet_callback(void)
 {
-	ir_packet_callback = ir_packet_ignore;
+	ir_current()->callback = ir_packet_ignore;
 }
 
-static int fifo_fd = -1;
+void ir_badge_select(struct ir_badge *badge)
+{
+	ir_this_badge = badge;
+}
 
-static void *read_from_fifo(void *thread_info)
+/* Packets arrive between ticks, as an interrupt would.  Everything queued is
+ * handed over in one go, and the space it took given back to the transport
+ * thread once at the end.
+ */
+int ir_badge_deliver(struct ir_badge *badge)
 {
-	int rc, count, bytesleft;
-	struct IRpacket_t buffer;
-	unsigned char *buf = (unsigned char *) &buffer;
-	struct stat s;
+	unsigned int head = badge->receive.head; /* only this thread changes it */
+	unsigned int tail = __atomic_load_n(&badge->receive.tail, __ATOMIC_ACQUIRE);
+	struct IRpacket_t p;
+	int count = tail - head;
+
+	if (!count)
+		return 0;
+	for (; head != tail; head++) {
+		p.v = badge->receive.event[head & (INPUT_RING_SIZE - 1)];
+		badge->callback(p);
+	}
+	__atomic_store_n(&badge->receive.head, head, __ATOMIC_RELEASE);
+	return count;
+}
 
-	rc = stat(FIFO_TO_BADGE, &s);
-	if (!rc) {
-		if (!S_ISFIFO(s.st_mode)) {
-			fprintf(stderr, "%s exists, but is not a named pipe.\n", FIFO_TO_BADGE);
-			exit(1);
+/* On the transport thread: read as much as fits straight into the free part
+ * of the badge's receive ring, and publish all the complete packets at once.
+ * A packet split across reads waits, unpublished, in its slot for the rest of
+ * it.  Stops when the fifo is empty or the ring is full.
+ */
+static void ir_read_fifo(struct ir_badge *b)
+{
+	struct input_ring *r = &b->receive;
+	unsigned int head, tail, n;
+	int rc;
+
+	do {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail; /* only this thread changes it */
+		if (tail - head == INPUT_RING_SIZE) {
+			/* The badge is behind, leave the rest in the fifo until it catches up */
+			if (!b->stalled) {
+				struct epoll_event ev = { .events = 0, .data.ptr = b };
+
+				epoll_ctl(ir_epoll_fd, EPOLL_CTL_MOD, b->fd, &ev);
+				b->stalled = 1;
+				ir_nstalled++;
+			}
+			return;
 		}
-	} else {
-		if (errno != ENOENT) {
-			fprintf(stderr, "Failed to stat %s: %s\n", FIFO_TO_BADGE, strerror(errno));
-			exit(1);
+		n = INPUT_RING_SIZE - (tail & (INPUT_RING_SIZE - 1)); /* free slots before the ring wraps */
+		if (n > INPUT_RING_SIZE - (tail - head))
+			n = INPUT_RING_SIZE - (tail - head);
+		rc = read(b->fd, (unsigned char *) &r->event[tail & (INPUT_RING_SIZE - 1)] + b->partial,
+				n * sizeof(r->event[0]) - b->partial);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc < 0 && errno != EAGAIN)
+				fprintf(stderr, "Failed to read IR fifo of badge 0x%04x: %s\n", b->id, strerror(errno));
+			return;
 		}
+		b->partial += rc;
+		if (b->partial >= (int) sizeof(r->event[0])) {
+			__atomic_store_n(&r->tail, tail + b->partial / sizeof(r->event[0]), __ATOMIC_RELEASE);
+			b->partial %= sizeof(r->event[0]);
+			b->received = 1;
+		}
+	} while (1);
+}
+
+/* On the transport thread: queue a packet from another badge.  IR is lossy,
+ * so if the receiver is that far behind, the packet is dropped.
+ */
+static void ir_receive(struct ir_badge *b, unsigned int packet)
+{
+	struct input_ring *r = &b->receive;
+	unsigned int tail = r->tail; /* only this thread changes it */
+	unsigned int used = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (used + (b->partial != 0) >= INPUT_RING_SIZE) {
+		__atomic_store_n(&b->lost, b->lost + 1, __ATOMIC_RELAXED);
+		return;
 	}
+	if (b->partial) /* keep the split fifo packet in the tail slot */
+		r->event[(tail + 1) & (INPUT_RING_SIZE - 1)] = r->event[tail & (INPUT_RING_SIZE - 1)];
+	r->event[tail & (INPUT_RING_SIZE - 1)] = packet;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	b->received = 1;
+}
 
-try_again:
-	fifo_fd = open(FIFO_TO_BADGE, O_RDONLY);
-	if (fifo_fd < 0) {
-		if (errno == ENOENT) {
-			rc = mkfifo(FIFO_TO_BADGE, 0644);
-			if (rc) {
-				fprintf(stderr, "Failed to create fifo %s\n", FIFO_TO_BADGE);
-				exit(1);
-			}
-			goto try_again;
+static uint64_t ir_now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* How many packets the badge may send now.  Sending time is saved up while
+ * the badge is quiet, but only enough for a short burst.
+ */
+#define IR_SEND_BURST 4
+static unsigned int ir_send_allowance(struct ir_badge *b, uint64_t cost, uint64_t now)
+{
+	if (!cost)
+		return INPUT_RING_SIZE;
+	b->send_credit += now - b->send_credit_time;
+	b->send_credit_time = now;
+	if (b->send_credit > cost * IR_SEND_BURST)
+		b->send_credit = cost * IR_SEND_BURST;
+	return b->send_credit / cost;
+}
+
+/* On the transport thread: everything each badge sent is received by all the
+ * others, or if there are no others, it goes to the base station, which is
+ * stdout.  A badge over its send rate keeps the rest queued for later.
+ */
+static void ir_send_all(int nbadges)
+{
+	uint64_t now = ir_now_ns(), cost;
+	unsigned int packet, allowed, rate;
+	struct ir_badge *b;
+	int i, j;
+
+	ir_nthrottled = 0;
+	for (i = 0; i < nbadges; i++) {
+		b = ir_badge[i];
+		if (__atomic_load_n(&b->send.tail, __ATOMIC_ACQUIRE) == b->send.head)
+			continue;
+		rate = __atomic_load_n(&b->send_rate, __ATOMIC_RELAXED);
+		cost = rate ? 1000000000ULL / rate : 0; /* ns per packet */
+		allowed = ir_send_allowance(b, cost, now);
+		for (; allowed && input_ring_get(&b->send, &packet); allowed--) {
+			b->send_credit -= cost;
+			if (nbadges < 2)
+				printf("Send packet to base station: 0x%08x\n", packet);
+			for (j = 0; j < nbadges; j++)
+				if (j != i)
+					ir_receive(ir_badge[j], packet);
+			__atomic_store_n(&b->sent, b->sent + 1, __ATOMIC_RELAXED);
 		}
-		fprintf(stderr, "Failed to open %s: %s\n", FIFO_TO_BADGE, strerror(errno));
-		exit(1);
-		return NULL;
+		if (!allowed && __atomic_load_n(&b->send.tail, __ATOMIC_ACQUIRE) != b->send.head)
+			ir_nthrottled++;
 	}
+}
+
+static void *ir_transport_main(__attribute__((unused)) void *arg)
+{
+	struct epoll_event ev[64];
+	struct ir_badge *b;
+	uint64_t kicks;
+	int i, n, nbadges, kicked;
 
-	count = 0;
-	bytesleft = 4;
 	do {
-		do {
-			rc = read(fifo_fd, &buf[count], bytesleft);
-			if (rc < 0 && errno == EINTR)
+		n = epoll_wait(ir_epoll_fd, ev, sizeof(ev) / sizeof(ev[0]), ir_nstalled || ir_nthrottled ? 1 : -1);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "IR transport: epoll_wait: %s\n", strerror(errno));
+			exit(1);
+		}
+		nbadges = __atomic_load_n(&ir_nbadges, __ATOMIC_ACQUIRE);
+		kicked = 0;
+		for (i = 0; i < n; i++) {
+			if (!ev[i].data.ptr) {
+				if (read(ir_kick_fd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN)
+					fprintf(stderr, "IR transport: eventfd: %s\n", strerror(errno));
+				/* Sends after this need another kick */
+				__atomic_store_n(&ir_kick_pending, 0, __ATOMIC_SEQ_CST);
+				kicked = 1;
 				continue;
-			if (rc < 0) {
-				fprintf(stderr, "Failed to read from %s: %s\n", FIFO_TO_BADGE, strerror(errno));
-				exit(1);
-				break;
 			}
-			if (rc == bytesleft) {
-				bytesleft = 4;
-				count = 0;
-				break;
+			ir_read_fifo(ev[i].data.ptr);
+		}
+		if (kicked || ir_nthrottled)
+			ir_send_all(nbadges);
+		for (i = 0; i < nbadges && ir_nstalled; i++) {
+			b = ir_badge[i];
+			if (b->stalled && b->receive.tail - __atomic_load_n(&b->receive.head, __ATOMIC_ACQUIRE) < INPUT_RING_SIZE) {
+				struct epoll_event e = { .events = EPOLLIN, .data.ptr = b };
+
+				epoll_ctl(ir_epoll_fd, EPOLL_CTL_MOD, b->fd, &e);
+				b->stalled = 0;
+				ir_nstalled--;
+				ir_read_fifo(b);
 			}
-			bytesleft -= rc;
-			count += rc;
-		} while (bytesleft > 0);
-		if (rc < 0)
-			break;
-		disable_interrupts();
-		ir_packet_callback(buffer);
-		enable_interrupts();
+		}
+		/* Wake each badge once for the whole batch */
+		for (i = 0; i < nbadges; i++) {
+			b = ir_badge[i];
+			if (b->received) {
+				b->received = 0;
+				b->wake(b->cookie);
+			}
+		}
 	} while (1);
 	return NULL;
 }
 
-void setup_ir_sensor()
+static void ir_transport_start(void)
 {
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
 	pthread_t thr;
 	int rc;
 
-	rc = pthread_create(&thr, NULL, read_from_fifo, NULL);
-	if (rc < 0)
-		fprintf(stderr, "Failed to create thread to read from fifo: %s\n", strerror(errno));
+	ir_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	ir_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ir_epoll_fd < 0 || ir_kick_fd < 0 || epoll_ctl(ir_epoll_fd, EPOLL_CTL_ADD, ir_kick_fd, &ev) < 0) {
+		fprintf(stderr, "Failed to set up IR transport: %s\n", strerror(errno));
+		exit(1);
+	}
+	rc = pthread_create(&thr, NULL, ir_transport_main, NULL);
+	if (rc) {
+		fprintf(stderr, "Failed to create IR transport thread: %s\n", strerror(rc));
+		exit(1);
+	}
+}
+
+/* Opened read-write so there is always a writer: otherwise the fifo would
+ * report end of file, over and over, whenever nobody outside has it open.
+ */
+static int ir_open_fifo(const char *fifo)
+{
+	struct stat s;
+	int fd;
+
+	if (!stat(fifo, &s)) {
+		if (!S_ISFIFO(s.st_mode)) {
+			fprintf(stderr, "%s exists, but is not a named pipe.\n", fifo);
+			return -1;
+		}
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "Failed to stat %s: %s\n", fifo, strerror(errno));
+		return -1;
+	} else if (mkfifo(fifo, 0644) && errno != EEXIST) {
+		fprintf(stderr, "Failed to create fifo %s: %s\n", fifo, strerror(errno));
+		return -1;
+	}
+	fd = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		fprintf(stderr, "Failed to open %s: %s\n", fifo, strerror(errno));
+	return fd;
+}
+
+/* Joins the room, if not in it already, and starts reading the fifo, if any */
+static int ir_badge_join(struct ir_badge *b, const char *fifo)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = b };
+	int rc = -1, added = 0;
+
+	pthread_once(&ir_transport_once, ir_transport_start);
+	pthread_mutex_lock(&ir_badge_lock);
+	if (!b->joined && ir_nbadges == IR_MAX_BADGES) {
+		fprintf(stderr, "Too many badges, at most %d\n", IR_MAX_BADGES);
+		goto out;
+	}
+	if (fifo && b->fd < 0) {
+		b->fd = ir_open_fifo(fifo);
+		if (b->fd < 0)
+			goto out;
+		if (epoll_ctl(ir_epoll_fd, EPOLL_CTL_ADD, b->fd, &ev) < 0) {
+			fprintf(stderr, "Failed to watch %s: %s\n", fifo, strerror(errno));
+			close(b->fd);
+			b->fd = -1;
+			goto out;
+		}
+	}
+	if (!b->joined) {
+		ir_badge[ir_nbadges] = b;
+		__atomic_store_n(&b->joined, 1, __ATOMIC_RELAXED);
+		added = 1;
+	}
+	/* Publishes the new badge, or the new fifo, to the transport thread */
+	__atomic_store_n(&ir_nbadges, ir_nbadges + added, __ATOMIC_RELEASE);
+	rc = 0;
+out:
+	pthread_mutex_unlock(&ir_badge_lock);
+	return rc;
+}
+
+struct ir_badge *ir_badge_new(unsigned int id, const char *fifo, void (*wake)(void *cookie), void *cookie)
+{
+	struct ir_badge *b = calloc(1, sizeof(*b));
+
+	if (!b)
+		return NULL;
+	b->id = id;
+	b->fd = -1;
+	b->wake = wake;
+	b->cookie = cookie;
+	b->callback = ir_packet_ignore;
+	if (ir_badge_join(b, fifo)) {
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+void setup_ir_sensor()
+{
+	if (ir_badge_join(&ir_default_badge, FIFO_TO_BADGE))
+		exit(1);
 }
 
 static pthread_mutex_t interrupt_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -456,16 +1144,123 @@ void enable_interrupts(void)
 	pthread_mutex_unlock(&interrupt_mutex);
 }
 
+/* Queued for the transport thread to send, so the badge code never waits on
+ * it.  A packet the same as the last one still waiting to go is sent only once.
+ */
 void IRqueueSend(union IRpacket_u packet)
 {
-	printf("Send packet to base station: 0x%08x\n", packet.v);
+	struct ir_badge *b = ir_current();
+	unsigned int tail = b->send.tail; /* only this thread changes it */
+
+	if (!__atomic_load_n(&b->joined, __ATOMIC_RELAXED) && ir_badge_join(b, NULL))
+		return;
+	/* The transport thread may take the last packet while it is being looked
+	 * at, so only once head shows it is still queued is this one redundant.
+	 */
+	if (tail != __atomic_load_n(&b->send.head, __ATOMIC_ACQUIRE) &&
+		b->send.event[(tail - 1) & (INPUT_RING_SIZE - 1)] == packet.v &&
+		tail != __atomic_load_n(&b->send.head, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&b->coalesced, b->coalesced + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (!input_ring_put(&b->send, packet.v)) {
+		__atomic_store_n(&b->dropped, b->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (!__atomic_exchange_n(&ir_kick_pending, 1, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+
+		if (write(ir_kick_fd, &one, sizeof(one)) < 0)
+			fprintf(stderr, "IR transport: eventfd: %s\n", strerror(errno));
+	}
+}
+
+void ir_badge_set_send_rate(struct ir_badge *badge, unsigned int packets_per_sec)
+{
+	__atomic_store_n(&(badge ? badge : ir_current())->send_rate, packets_per_sec, __ATOMIC_RELAXED);
+}
+
+void ir_badge_stats(struct ir_badge *badge, struct ir_stats *stats)
+{
+	struct ir_badge *b = badge ? badge : ir_current();
+	unsigned int head = __atomic_load_n(&b->send.head, __ATOMIC_ACQUIRE);
+
+	stats->queued = __atomic_load_n(&b->send.tail, __ATOMIC_ACQUIRE) - head;
+	stats->sent = __atomic_load_n(&b->sent, __ATOMIC_RELAXED);
+	stats->coalesced = __atomic_load_n(&b->coalesced, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&b->dropped, __ATOMIC_RELAXED);
+	stats->lost = __atomic_load_n(&b->lost, __ATOMIC_RELAXED);
 }
 
 unsigned int get_badge_id(void)
 {
-	return 0x0100;
+	return ir_current()->id;
+}
+
+static struct profile_counter expose_profile;
+
+void profile_enable(void)
+{
+	profiling = 1;
+}
+
+unsigned long long profile_now_ns(void)
+{
+	return ir_now_ns();
+}
+
+void profile_add(struct profile_counter *c, unsigned long long start_ns)
+{
+	unsigned long long ns = profile_now_ns() - start_ns;
+	unsigned long long max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->total_ns, ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&c->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* A NULL name prints the heading */
+void profile_print(const char *name, struct profile_counter *c)
+{
+	unsigned long count;
+	unsigned long long total, max;
+
+	if (!name) {
+		fprintf(stderr, "%-34s %10s %12s %10s %10s\n",
+				"state", "count", "total ms", "mean us", "max us");
+		return;
+	}
+	count = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+	total = __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+	if (count)
+		fprintf(stderr, "%-34s %10lu %12.3f %10.3f %10.3f\n",
+				name, count, total / 1e6, total / 1e3 / count, max / 1e3);
+}
+
+static void latency_print(const char *name, struct latency_histogram *h)
+{
+	if (!name)
+		fprintf(stderr, "%-34s %10s %10s %10s %10s %10s %10s\n",
+				"latency", "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	else if (h->count)
+		fprintf(stderr, "%-34s %10lu %10llu %10llu %10llu %10llu %10llu\n",
+				name, h->count, latency_percentile(h, 50), latency_percentile(h, 90),
+				latency_percentile(h, 99), latency_percentile(h, 99.9), h->max_us);
+}
+
+void profile_print_linuxcompat(void)
+{
+	profile_print("drawing_area_expose", &expose_profile);
+	if (!key_to_swap_latency.count)
+		return;
+	latency_print(NULL, NULL);
+	latency_print("keypress to FbSwapBuffers", &key_to_swap_latency);
+	latency_print("keypress to drawing_area_expose", &key_to_paint_latency);
 }
 
+#ifndef LINUXCOMPAT_HEADLESS
 static void setup_window_geometry(GtkWidget *window)
 {
 	/* clamp window aspect ratio to constant */
@@ -500,54 +1295,113 @@ static gint key_press_cb(GtkWidget* widget, GdkEventKey* event, gpointer data)
 
 	case GDK_w:
 	case GDK_KEY_Up:
-		button_pressed[UP] = 1;
+		input_ring_put(&key_ring, UP);
 		break;
 	case GDK_s:
 	case GDK_KEY_Down:
-		button_pressed[DOWN] = 1;
+		input_ring_put(&key_ring, DOWN);
 		break;
 	case GDK_a:
 	case GDK_KEY_Left:
-		button_pressed[LEFT] = 1;
+		input_ring_put(&key_ring, LEFT);
 		break;
 	case GDK_d:
 	case GDK_KEY_Right:
-		button_pressed[RIGHT] = 1;
+		input_ring_put(&key_ring, RIGHT);
 		break;
 	case GDK_space:
 	case GDK_KEY_Return:
-		button_pressed[BUTTON] = 1;
+		input_ring_put(&key_ring, BUTTON);
 		break;
 	case GDK_q:
 	case GDK_KEY_Escape:
 		time_to_quit = 1;
 		break;
+	default:
+		return TRUE;
 	}
+	if (profiling && !fb_this_thread()->key_ns)
+		fb_this_thread()->key_ns = profile_now_ns();
+	wake_badge();
 	return TRUE;
 }
 
-static int drawing_area_expose(GtkWidget *widget, GdkEvent *event, gpointer p)
+static void setup_rgb_buffer(void)
+{
+	pixel_width = real_screen_width / SCREEN_XDIM;
+	if (pixel_width < 1)
+		pixel_width = 1;
+	pixel_height = real_screen_height / SCREEN_YDIM;
+	if (pixel_height < 1)
+		pixel_height = 1;
+	free(rgb_buffer);
+	rgb_buffer = malloc(SCREEN_XDIM * pixel_width * SCREEN_YDIM * pixel_height * 3);
+}
+
+static int draw_exposed_area(GtkWidget *widget, GdkEvent *event)
 {
-	/* Draw the screen */
-	int x, y, w, h;
-
-	w = real_screen_width / SCREEN_XDIM;
-	if (w < 1)
-		w = 1;
-	h = real_screen_height / SCREEN_YDIM;
-	if (h < 1)
-		h = 1;
-
-	for (y = 0; y < SCREEN_YDIM; y++) {
-		for (x = 0; x < SCREEN_XDIM; x++) {
-			unsigned char c = live_screen_color[x][y] % NCOLORS;
-			gdk_gc_set_foreground(gc, &huex[c]);
-			gdk_draw_rectangle(widget->window, gc, 1 /* filled */, x * w, y * h, w, h);
+	struct framebuffer *f = fb_this_thread();
+
+	/* Draw the exposed part of the screen: expand live_screen_color into one
+	 * RGB image and send that to the X server in one go rather than a
+	 * rectangle per pixel.
+	 */
+	int x, y, i, rowstride, x1, y1, x2, y2;
+	unsigned char *row, *pixel;
+
+	if (!rgb_buffer)
+		setup_rgb_buffer();
+	rowstride = SCREEN_XDIM * pixel_width * 3;
+
+	x1 = event->expose.area.x / pixel_width;
+	y1 = event->expose.area.y / pixel_height;
+	x2 = (event->expose.area.x + event->expose.area.width - 1) / pixel_width;
+	y2 = (event->expose.area.y + event->expose.area.height - 1) / pixel_height;
+	if (x2 > SCREEN_XDIM - 1)
+		x2 = SCREEN_XDIM - 1;
+	if (y2 > SCREEN_YDIM - 1)
+		y2 = SCREEN_YDIM - 1;
+	if (x1 > x2 || y1 > y2)
+		return 0;
+
+	for (y = y1; y <= y2; y++) {
+		row = rgb_buffer + y * pixel_height * rowstride + x1 * pixel_width * 3;
+		pixel = row;
+		for (x = x1; x <= x2; x++) {
+			unsigned char *rgb = huex_rgb[f->live_screen_color[y][x] % NCOLORS];
+			for (i = 0; i < pixel_width; i++) {
+				*pixel++ = rgb[0];
+				*pixel++ = rgb[1];
+				*pixel++ = rgb[2];
+			}
 		}
+		for (i = 1; i < pixel_height; i++)
+			memcpy(row + i * rowstride, row, pixel - row);
 	}
+	gdk_draw_rgb_image(widget->window, gc, x1 * pixel_width, y1 * pixel_height,
+			(x2 - x1 + 1) * pixel_width, (y2 - y1 + 1) * pixel_height,
+			GDK_RGB_DITHER_NONE, rgb_buffer + y1 * pixel_height * rowstride + x1 * pixel_width * 3,
+			rowstride);
 	return 0;
 }
 
+static int drawing_area_expose(GtkWidget *widget, GdkEvent *event, gpointer p)
+{
+	unsigned long long start;
+	int rc;
+
+	if (!profiling)
+		return draw_exposed_area(widget, event);
+	start = profile_now_ns();
+	rc = draw_exposed_area(widget, event);
+	profile_add(&expose_profile, start);
+	if (fb_this_thread()->key_queued_ns) {
+		latency_record(&key_to_paint_latency, fb_this_thread()->key_queued_ns);
+		fb_this_thread()->key_queued_ns = 0;
+	}
+	return rc;
+}
+
 static gint drawing_area_configure(GtkWidget *w, GdkEventConfigure *event)
 {
         GdkRectangle cliprect;
@@ -570,11 +1424,14 @@ static gint drawing_area_configure(GtkWidget *w, GdkEventConfigure *event)
         cliprect.width = real_screen_width;
         cliprect.height = real_screen_height;
         gdk_gc_set_clip_rectangle(gc, &cliprect);
+	setup_rgb_buffer();
 	return TRUE;
 }
 
 static void setup_gtk_colors(void)
 {
+	int i;
+
 	gdk_color_parse("white", &huex[WHITE]);
 	gdk_color_parse("blue", &huex[BLUE]);
 	gdk_color_parse("black", &huex[BLACK]);
@@ -583,6 +1440,12 @@ static void setup_gtk_colors(void)
 	gdk_color_parse("red", &huex[RED]);
 	gdk_color_parse("cyan", &huex[CYAN]);
 	gdk_color_parse("MAGENTA", &huex[MAGENTA]);
+
+	for (i = 0; i < NCOLORS; i++) {
+		huex_rgb[i][0] = huex[i].red >> 8;
+		huex_rgb[i][1] = huex[i].green >> 8;
+		huex_rgb[i][2] = huex[i].blue >> 8;
+	}
 }
 
 static void setup_gtk_window_and_drawing_area(GtkWidget **window, GtkWidget **vbox, GtkWidget **drawing_area)
@@ -630,15 +1493,65 @@ static void setup_gtk_window_and_drawing_area(GtkWidget **window, GtkWidget **vb
 
 static gint advance_game(__attribute__((unused)) gpointer data)
 {
+	static unsigned int queued_generation = 0;
+	struct framebuffer *f = fb_this_thread();
+
 	if (time_to_quit)
 		exit(0);
+	ir_badge_deliver(&ir_default_badge);
+	badge_waiting_for_input = 0;
 	badge_function();
-	gdk_threads_enter();
-	gtk_widget_queue_draw(drawing_area);
-	gdk_threads_leave();
+	if (f->frame_generation != queued_generation && f->damage.x1 <= f->damage.x2) {
+		/* A new frame was swapped in since the last redraw was queued, and it differs */
+		gdk_threads_enter();
+		gtk_widget_queue_draw_area(drawing_area, f->damage.x1 * pixel_width, f->damage.y1 * pixel_height,
+				(f->damage.x2 - f->damage.x1 + 1) * pixel_width,
+				(f->damage.y2 - f->damage.y1 + 1) * pixel_height);
+		gdk_threads_leave();
+		fb_rect_clear(&f->damage);
+		if (f->key_swapped_ns && !f->key_queued_ns)
+			f->key_queued_ns = f->key_swapped_ns;
+		f->key_swapped_ns = 0;
+	} else if (f->frame_generation != queued_generation && f->key_swapped_ns) {
+		/* The answer to the key looks just like what is on the screen already */
+		latency_record(&key_to_paint_latency, f->key_swapped_ns);
+		f->key_swapped_ns = 0;
+	}
+	queued_generation = f->frame_generation;
+	if (badge_waiting_for_input) {
+		timer_tag = 0;
+		return FALSE; /* until wake_badge() */
+	}
 	return TRUE;
 }
 
+static int wake_pending = 0; /* a restart_badge() is queued, only changed atomically */
+
+/* On the GTK thread: if the badge code is waiting for input, run it now, and
+ * keep running it unless it goes straight back to waiting.
+ */
+static gboolean restart_badge(__attribute__((unused)) gpointer data)
+{
+	__atomic_store_n(&wake_pending, 0, __ATOMIC_SEQ_CST);
+	if (!timer_tag && advance_game(NULL))
+		timer_tag = g_timeout_add(timer_interval_ms, advance_game, NULL);
+	return FALSE;
+}
+
+static void (*profile_signal_print)(void);
+
+static gboolean profile_signal(__attribute__((unused)) gpointer data)
+{
+	profile_signal_print();
+	return TRUE; /* and keep watching for the signal */
+}
+
+void profile_print_on_signal(int sig, void (*print)(void))
+{
+	profile_signal_print = print;
+	g_unix_signal_add(sig, profile_signal, NULL);
+}
+
 void start_gtk(int *argc, char ***argv, int (*main_badge_function)(void), int callback_hz)
 {
 	gtk_set_locale();
@@ -646,7 +1559,8 @@ void start_gtk(int *argc, char ***argv, int (*main_badge_function)(void), int ca
 	setup_gtk_colors();
 	setup_gtk_window_and_drawing_area(&window, &vbox, &drawing_area);
 	badge_function = main_badge_function;
-	timer_tag = g_timeout_add(1000 / callback_hz, advance_game, NULL);
+	timer_interval_ms = 1000 / callback_hz;
+	timer_tag = g_timeout_add(timer_interval_ms, advance_game, NULL);
 
 #if 0
 	/* Apparently (some versions of?) portaudio calls g_thread_init(). */
@@ -658,11 +1572,43 @@ void start_gtk(int *argc, char ***argv, int (*main_badge_function)(void), int ca
 	gdk_threads_init();
 	gtk_main();
 }
+#endif /* LINUXCOMPAT_HEADLESS */
+
+/* Called by the badge code when it has nothing to do until there is input.
+ * It won't be called again until a button is pressed or an IR packet arrives,
+ * rather than being polled for nothing.
+ */
+void wait_for_input(void)
+{
+#ifndef LINUXCOMPAT_HEADLESS
+	badge_waiting_for_input = 1;
+#endif
+}
+
+/* Called from any thread after queueing an input event */
+static void wake_badge(void)
+{
+#ifndef LINUXCOMPAT_HEADLESS
+	if (!__atomic_exchange_n(&wake_pending, 1, __ATOMIC_SEQ_CST))
+		g_idle_add(restart_badge, NULL); /* safe from any thread, runs on the GTK one */
+#endif
+}
 
 static int generic_button_pressed(int which_button)
 {
+	unsigned int button;
+	struct framebuffer *f;
+
+	while (input_ring_get(&key_ring, &button))
+		button_pressed[button]++;
+	if (profiling) {
+		f = fb_this_thread();
+		if (f->key_ns && !f->key_seen_ns)
+			f->key_seen_ns = f->key_ns;
+		f->key_ns = 0;
+	}
 	if (button_pressed[which_button]) {
-		button_pressed[which_button] = 0;
+		button_pressed[which_button]--;
 		return 1;
 	}
 	return 0;
@@ -5,10 +5,13 @@
 void FbInit(void);
 void plot_point(int x, int y, void *context);
 void FbSwapBuffers(void);
-void FbLine(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2);
-void FbHorizontalLine(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2);
-void FbVerticalLine(unsigned char x1, unsigned char y1, unsigned char x2, unsigned char y2);
+/* Line coordinates may be off the screen, lines are clipped to it */
+void FbLine(int x1, int y1, int x2, int y2);
+void FbHorizontalLine(int x1, int y1, int x2, int y2);
+void FbVerticalLine(int x1, int y1, int x2, int y2);
 void FbClear(void);
+void FbCacheStore(unsigned int key);
+int FbCacheRestore(unsigned int key);
 void FbMove(unsigned char x, unsigned char y);
 void FbWriteLine(char *s);
 void itoa(char *string, int value, int base);
@@ -21,6 +24,10 @@ void disable_interrupts(void);
 void enable_interrupts(void);
 unsigned int get_badge_id(void);
 void start_gtk(int *argc, char ***argv, int (*main_badge_function)(void), int callback_hz);
+/* The badge function has nothing to do until a button is pressed or an IR packet
+ * arrives, so don't call it again until then.
+ */
+void wait_for_input(void);
 
 #define BLUE    0
 #define GREEN   1
@@ -68,3 +75,47 @@ void IRqueueSend(union IRpacket_u pkt);
 void register_ir_packet_callback(void (*callback)(struct IRpacket_t));
 void unregister_ir_packet_callback(void);
 
+/* Simulating a room full of badges in one process.  Each has its own id, and
+ * optionally a fifo through which packets can be sent to it from outside.
+ * Whatever one badge sends with IRqueueSend() is received by all the others.
+ * wake is called, from the IR transport thread, when packets arrive for the
+ * badge; the thread running it then hands them to its callback with
+ * ir_badge_deliver().  A thread is the default badge (the one start_gtk()
+ * runs, with FIFO_TO_BADGE once setup_ir_sensor() is called) until
+ * ir_badge_select() says otherwise.  Badges last until exit.
+ */
+struct ir_badge;
+struct ir_badge *ir_badge_new(unsigned int id, const char *fifo, void (*wake)(void *cookie), void *cookie);
+void ir_badge_select(struct ir_badge *badge);
+int ir_badge_deliver(struct ir_badge *badge); /* returns the number of packets delivered */
+
+/* Sending is limited to packets_per_sec, like the real IR link, with short
+ * bursts allowed after a quiet spell.  0, the default, means no limit.
+ * A NULL badge means the calling thread's.
+ */
+void ir_badge_set_send_rate(struct ir_badge *badge, unsigned int packets_per_sec);
+
+struct ir_stats {
+	unsigned int queued; /* waiting to be sent */
+	unsigned long sent;
+	unsigned long coalesced; /* the same as the packet queued before it, so not queued again */
+	unsigned long dropped; /* the send queue was full */
+	unsigned long lost; /* sent to this badge, but its receive queue was full */
+};
+void ir_badge_stats(struct ir_badge *badge, struct ir_stats *stats);
+
+/* Where the time goes: how often something took how long, for a profile */
+struct profile_counter {
+	unsigned long count;
+	unsigned long long total_ns, max_ns;
+};
+void profile_enable(void); /* also times drawing the screen */
+unsigned long long profile_now_ns(void);
+void profile_add(struct profile_counter *c, unsigned long long start_ns); /* from any thread */
+/* These print to stderr, so don't call them from a signal handler */
+void profile_print(const char *name, struct profile_counter *c);
+void profile_print_linuxcompat(void);
+/* Calls print() from the GTK main loop, not the handler, each time the process
+ * gets sig.  It runs even while the badge code is waiting for input.
+ */
+void profile_print_on_signal(int sig, void (*print)(void));
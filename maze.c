@@ -13,8 +13,8 @@
  of time (though it does have some compatibility bodges that
  allow it to run as a native linux program too.)  That is
  why maze_cb() is just a big switch statement that does
- different things based on maze_program_state and why there
- are so many global variables.  So the weirdness is there
+ different things based on game->state and why all the
+ state lives in one big struct maze_game.  So the weirdness is there
  for a reason, and is not how I would normally write a program.
 
 **********************************************/
@@ -22,9 +22,51 @@
 #include <stdio.h>
 #include <sys/time.h> /* for gettimeofday */
 #include <string.h> /* for memset */
+#include <stdlib.h> /* for atoi, strtoul */
 
 #include "linuxcompat.h"
 #include "bline.h"
+
+#ifndef MAZE_BENCHMARK
+/* The benchmark generates thousands of levels, and doesn't want this chatter */
+#define MAZE_DEBUG_PRINTS 1
+
+/* Generate the levels above and below this one with worker threads, see maze_pregen_request() */
+#define MAZE_PREGENERATE 1
+#include <pthread.h>
+
+/* Save and resume games, see maze_checkpoint() */
+#define MAZE_SAVE_GAMES 1
+#include <fcntl.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+/* The benchmark replays each recorded session in its own process */
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* and can play many games at once on a pool of threads, see maze_sched_new() */
+#define MAZE_SCHEDULER 1
+#include <pthread.h>
+
+/* and flood the IR transport, see maze_ir_bench() */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+/* The linux framebuffer can cache whole screens, see FbCacheStore() */
+#define MAZE_CORRIDOR_CACHE 1
+
+/* Record and replay sessions, see maze_input() */
+#define MAZE_INPUT_LOG 1
+
+/* Time each state when asked to, see maze_profile_start() */
+#define MAZE_PROFILE 1
+#include <signal.h>
 #else
 #include "colors.h"
 #include "menu.h"
@@ -83,61 +125,117 @@ enum maze_program_state_t {
     MAZE_WIN_CONDITION,
     MAZE_EXIT,
 };
-static enum maze_program_state_t maze_program_state = MAZE_GAME_INIT;
-static int maze_back_wall_distance = 7;
-static int maze_object_distance_limit = 0;
-static int maze_start = 0;
-static int maze_scale = 12;
-static int current_drawing_object = 0;
-static unsigned int xorshift_state = 0xa5a5a5a5;
-static unsigned char combat_mode = 0;
 
 #define TERMINATE_CHANCE 5
 #define BRANCH_CHANCE 30
 #define OBJECT_CHANCE 20
 
-/* Dimensions of generated maze */
-#define XDIM 24 /* Must be divisible by 8 */
-#define YDIM 24
+/* Dimensions of generated maze.  The maze may be any size up to
+ * MAZE_MAX_XDIM x MAZE_MAX_YDIM, see maze_set_dimensions().
+ */
+#ifdef __linux__
+#define MAZE_MAX_XDIM 4096
+#define MAZE_MAX_YDIM 4096
+#else
+#define MAZE_MAX_XDIM 24
+#define MAZE_MAX_YDIM 24
+#endif
+#define MAZE_MIN_DIM 8
+static int maze_xdim = 24;
+static int maze_ydim = 24;
 #define NLEVELS 3
 
-static unsigned int maze_random_seed[NLEVELS] = { 0 };
-static int maze_previous_level = -1;
-static int maze_current_level = 0;
-static char game_is_won = 0;
 static char level_color[] = { YELLOW, CYAN, WHITE };
 
 #define MAZE_PLACE_PLAYER_DO_NOT_MOVE 0
 #define MAZE_PLACE_PLAYER_BENEATH_UP_LADDER 1
 #define MAZE_PLACE_PLAYER_ABOVE_DOWN_LADDER 2
-static int maze_player_initial_placement = MAZE_PLACE_PLAYER_BENEATH_UP_LADDER;
 
 /* Array to hold the maze.  Each square of the maze is represented by 1 bit.
- * 0 means solid rock, 1 means empty passage.
+ * 0 means solid rock, 1 means empty passage.  The bits are packed into 64 bit
+ * words, row by row, with maze_row_words words per row.  The maze is surrounded
+ * by a one square guard border whose bits are set, so that diggable() sees the
+ * edge of the maze as passage it must not connect to, without bounds checks.
+ * Square x,y is bit x + 1 of row y + 1.  Only the first (maze_ydim + 2) rows
+ * are in use.  A game's maze and visited bitmaps are those of the level being
+ * played, which are swapped with those of a generator when a level is installed
+ * (see maze_gen_install()).  On linux they are allocated to fit the maze, on the
+ * badge there is only ever one game, and its bitmaps are these.
+ */
+typedef unsigned long long maze_word;
+#define MAZE_WORD_BITS 64
+#define MAZE_MAX_ROW_WORDS ((MAZE_MAX_XDIM + 2 + MAZE_WORD_BITS - 1) / MAZE_WORD_BITS)
+#ifndef __linux__
+static maze_word maze_storage[MAZE_MAX_ROW_WORDS * (MAZE_MAX_YDIM + 2)];
+static maze_word maze_visited_storage[MAZE_MAX_ROW_WORDS * (MAZE_MAX_YDIM + 2)];
+#endif
+static int maze_row_words = 1;
+
+/* Sets the size of maze every game is played in, clamped to what the bitmaps can
+ * hold.  Only call this before any game is set up, see maze_game_setup().
  */
-static unsigned char maze[XDIM >> 3][YDIM] = { { 0 }, };
-static unsigned char maze_visited[XDIM >> 3][YDIM] = { { 0 }, };
+static void maze_set_dimensions(int xdim, int ydim)
+{
+    if (xdim < MAZE_MIN_DIM)
+        xdim = MAZE_MIN_DIM;
+    if (xdim > MAZE_MAX_XDIM)
+        xdim = MAZE_MAX_XDIM;
+    if (ydim < MAZE_MIN_DIM)
+        ydim = MAZE_MIN_DIM;
+    if (ydim > MAZE_MAX_YDIM)
+        ydim = MAZE_MAX_YDIM;
+    maze_xdim = xdim;
+    maze_ydim = ydim;
+    maze_row_words = (xdim + 2 + MAZE_WORD_BITS - 1) / MAZE_WORD_BITS;
+}
+
+/* Index of the bitmap word holding square x,y, and the bit within it */
+#define MAZE_WORD(x, y) (((y) + 1) * maze_row_words + ((x) + 1) / MAZE_WORD_BITS)
+#define MAZE_SHIFT(x) (((x) + 1) % MAZE_WORD_BITS)
+#define MAZE_BIT(x) (1ULL << MAZE_SHIFT(x))
+#define MAZE_BITMAP_WORDS (maze_row_words * (maze_ydim + 2)) /* words in use */
+
+/* Clears the part of a pair of bitmaps this size of maze uses, and sets up the guard border */
+static void maze_clear_bitmaps(maze_word *m, maze_word *visited)
+{
+    int y, nwords = MAZE_BITMAP_WORDS;
+
+    memset(m, 0, sizeof(m[0]) * nwords);
+    memset(visited, 0, sizeof(visited[0]) * nwords);
+    memset(m, 0xff, sizeof(m[0]) * maze_row_words);
+    memset(&m[nwords - maze_row_words], 0xff, sizeof(m[0]) * maze_row_words);
+    for (y = 0; y < maze_ydim; y++) {
+        m[MAZE_WORD(-1, y)] |= MAZE_BIT(-1);
+        m[MAZE_WORD(maze_xdim, y)] |= MAZE_BIT(maze_xdim);
+    }
+}
+
 
 /*
  * Stack structure used when generating maze to remember where we left off.
+ * On linux the stack grows as needed.  On the badge it is a fixed array, and
+ * when it fills up the oldest entry is forgotten (that branch of the maze is
+ * simply not dug any further) rather than throwing the level away.
  */
-static struct maze_gen_stack_element {
-    unsigned char x, y, direction;
-} maze_stack[50];
+struct maze_gen_stack_element {
+    unsigned short x, y;
+    unsigned char direction;
+};
+#define MAZE_STACK_SIZE 50 /* initial size on linux, fixed size on the badge */
 #define MAZE_STACK_EMPTY -1
-static short maze_stack_ptr = MAZE_STACK_EMPTY;
-static int maze_size = 0;
-static int max_maze_stack_depth = 0;
-static int generation_iterations = 0;
+#ifndef __linux__
+static struct maze_gen_stack_element maze_stack_storage[MAZE_STACK_SIZE];
+#endif
 
-static struct player_state {
-    unsigned char x, y, direction;
+struct player_state {
+    unsigned short x, y;
+    unsigned char direction;
     unsigned char combatx, combaty;
     unsigned char hitpoints;
     unsigned char weapon;
     unsigned char armor;
     int gp;
-} player, combatant;
+};
 
 struct point {
     signed char x, y;
@@ -145,27 +243,26 @@ struct point {
 
 static struct potion_descriptor {
     char *adjective;
-    signed char health_impact;
 } potion_type[] = {
-    { "SMELLY", 0 },
-    { "FUNKY", 0 },
-    { "MISTY", 0 },
-    { "FROTHY", 0 },
-    { "FOAMY", 0 },
-    { "FULMINATING", 0 },
-    { "SMOKING", 0 },
-    { "SPARKLING", 0 },
-    { "BUBBLING", 0 },
-    { "ACRID", 0 },
-    { "PUNGENT", 0 },
-    { "STINKY", 0 },
-    { "AROMATIC", 0 },
-    { "GELATINOUS", 0 },
-    { "JIGGLY", 0 },
-    { "GLOWING", 0 },
-    { "LUMINESCENT", 0 },
-    { "PEARLESCENT", 0 },
-    { "FRUITY", 0 },
+    { "SMELLY" },
+    { "FUNKY" },
+    { "MISTY" },
+    { "FROTHY" },
+    { "FOAMY" },
+    { "FULMINATING" },
+    { "SMOKING" },
+    { "SPARKLING" },
+    { "BUBBLING" },
+    { "ACRID" },
+    { "PUNGENT" },
+    { "STINKY" },
+    { "AROMATIC" },
+    { "GELATINOUS" },
+    { "JIGGLY" },
+    { "GLOWING" },
+    { "LUMINESCENT" },
+    { "PEARLESCENT" },
+    { "FRUITY" },
 };
 
 static struct weapon_descriptor {
@@ -248,7 +345,7 @@ struct maze_object_template {
 };
 
 struct maze_object {
-    unsigned char x, y;
+    unsigned short x, y;
     unsigned char type;
     union maze_object_type_specific_data tsd;
 };
@@ -329,7 +426,7 @@ struct maze_menu_item {
     unsigned char cookie;
 };
 
-static struct maze_menu {
+struct maze_menu {
     char title[15];
     char title2[15];
     char title3[15];
@@ -338,145 +435,369 @@ static struct maze_menu {
     unsigned char current_item;
     unsigned char menu_active;
     unsigned char chosen_cookie;
-} maze_menu;
+};
+
+/* Special values of maze_object.x for objects that are not on the board.
+ * (x == 0 means the slot is free, as the edge of the maze is never dug.)
+ */
+#define MAZE_OBJECT_IN_POCKET 0xffff
+#define MAZE_OBJECT_USED_UP 0xfffe
+
+/* Index of maze objects by location, so that finding what is at (x, y) does
+ * not mean looking at every object.  Objects are hashed by location into
+ * buckets, each bucket a list linked through object_next[], kept in object
+ * order so that lookups see objects in the same order a scan would.  Objects in
+ * the player's pocket are all at (MAZE_OBJECT_IN_POCKET, 0).
+ */
+#define MAZE_OBJECT_BUCKETS 64 /* power of 2, at least twice MAX_MAZE_OBJECTS */
+#define MAZE_OBJECT_NONE 255
+
+/* What a level is generated from.  Requests which compare equal produce identical
+ * levels, which is what allows a level generated ahead of time to stand in for
+ * one generated when the player arrives.
+ */
+struct maze_gen_request {
+    int level;
+    unsigned int seed;
+    int placement; /* game->player_initial_placement */
+    int nobjects; /* game->nobjects carried over from the last level, affects where objects go */
+    unsigned int pocket; /* bit i set if game->object[i] is in the player's pocket */
+};
+
+/* Everything generate_maze() works on, so that more than one level can be built
+ * at once.  All generators share the maze dimensions, see maze_set_dimensions().
+ */
+struct maze_generator {
+    struct maze_gen_request req;
+    unsigned int seed; /* req.seed, or the new seed after starting over */
+    unsigned int xorshift_state;
+    maze_word *maze, *visited;
+    struct maze_gen_stack_element *stack;
+    int stack_ptr, stack_size;
+    int maze_size, max_stack_depth, iterations;
+    int too_small_restarts, dropped_stack_entries;
+    struct maze_object object[MAX_MAZE_OBJECTS];
+    int nobjects;
+    unsigned short player_x, player_y;
+};
+
+#ifdef MAZE_PREGENERATE
+/* A level being generated in the background, see maze_pregen_request() */
+struct maze_pregen_slot {
+    struct maze_gen_request want;
+    struct maze_generator gen; /* gen.req is what was built */
+    int state;
+    struct maze_pregen_slot *next; /* in maze_pregen_queue */
+};
+#endif
+
+/* Levels the player has left, see maze_level_cache_store() */
+#ifdef __linux__
+#define MAZE_LEVEL_CACHE_ENTRIES (NLEVELS - 1) /* enough for every level */
+#else
+#define MAZE_LEVEL_CACHE_ENTRIES 1 /* just the level the player came from */
+#endif
+
+struct maze_level_cache_entry {
+    int in_use, level;
+    unsigned int last_used;
+    maze_word *maze, *visited;
+    struct maze_object object[MAX_MAZE_OBJECTS]; /* the objects on the board, in order */
+    int nobjects;
+    unsigned short player_x, player_y;
+};
+
+/* What the player can see looking down the corridor.  Everything render_maze()
+ * draws depends only on this and the color, so on linux it also serves as the
+ * key for caching the rendered corridor (see FbCacheStore()).
+ */
+#define MAZE_VIEW_STEPS 7
+#define MAZE_VIEW_NOTHING 0 /* beyond the edge of the maze */
+#define MAZE_VIEW_WALL 1
+#define MAZE_VIEW_PASSAGE 2
+#define MAZE_VIEW_UNCACHEABLE 0xffffffff
+struct maze_view {
+    unsigned char left[MAZE_VIEW_STEPS], right[MAZE_VIEW_STEPS];
+    unsigned char back_wall; /* steps to the wall we are facing, MAZE_VIEW_STEPS if none in view */
+    unsigned int key;
+};
+
+/* Everything about one game.  Every function that plays the game is handed the
+ * game it is playing, so one process can host any number of them.  maze_cb()
+ * plays a single game; on linux more can be made with maze_game_new() and each
+ * stepped with maze_game_cb(), on any thread, so long as no game is stepped by
+ * two threads at once.
+ */
+struct maze_game {
+    enum maze_program_state_t state; /* initially MAZE_GAME_INIT */
+    unsigned int xorshift_state;
+    unsigned int random_seed[NLEVELS];
+    signed char potion_health_impact[ARRAYSIZE(potion_type)];
+    int previous_level, current_level;
+    int player_initial_placement;
+    char game_is_won;
+    unsigned char combat_mode;
+    struct player_state player, combatant;
+    struct maze_menu menu;
+
+    /* The level being played */
+    maze_word *maze, *visited;
+    struct maze_object object[MAX_MAZE_OBJECTS];
+    int nobjects;
+    unsigned char object_bucket[MAZE_OBJECT_BUCKETS]; /* see maze_object_first_at() */
+    unsigned char object_next[MAX_MAZE_OBJECTS];
+    int maze_size, max_stack_depth, generation_iterations; /* for print_maze() */
+
+    /* What draw_encounter() shows, and the monster being fought */
+    char *encounter_text, *encounter_adjective, *encounter_name;
+    unsigned char encounter_object;
+
+    /* How far render_maze() and draw_objects() have got with this frame */
+    struct maze_view view;
+    int render_step, render_start, render_scale;
+    int back_wall_distance, object_distance_limit;
+    int drawing_object;
+
+    struct maze_generator gen; /* the one maze_build() steps through MAZE_BUILD */
+    struct maze_level_cache_entry level_cache[MAZE_LEVEL_CACHE_ENTRIES];
+    unsigned int level_cache_clock;
+#ifdef MAZE_PREGENERATE
+    struct maze_pregen_slot pregen_slot[NLEVELS];
+#endif
+#ifdef MAZE_SAVE_GAMES
+    time_t last_checkpoint;
+    void *save_mapping; /* of the saved game this one was resumed from */
+    size_t save_mapping_size;
+#endif
+#ifdef MAZE_SCHEDULER
+    struct maze_session *session; /* if the scheduler is playing this game, see maze_sched_add() */
+#endif
+};
+
+static unsigned char *maze_object_bucket_of(struct maze_game *game, int x, int y)
+{
+    return &game->object_bucket[(x + y * 37) & (MAZE_OBJECT_BUCKETS - 1)];
+}
+
+static void maze_object_index_add(struct maze_game *game, int i)
+{
+    unsigned char *p = maze_object_bucket_of(game, game->object[i].x, game->object[i].y);
 
-static struct maze_object maze_object[MAX_MAZE_OBJECTS];
-static int nmaze_objects = 0;
+    while (*p != MAZE_OBJECT_NONE && *p < i)
+        p = &game->object_next[*p];
+    game->object_next[i] = *p;
+    *p = i;
+}
 
-static void maze_menu_clear(void)
+static void maze_object_index_remove(struct maze_game *game, int i)
 {
-    maze_menu.title[0] = '\0';
-    maze_menu.title2[0] = '\0';
-    maze_menu.title3[0] = '\0';
-    maze_menu.nitems = 0;
-    maze_menu.current_item = 0;
-    maze_menu.menu_active = 0;
-    maze_menu.chosen_cookie = 0;
+    unsigned char *p = maze_object_bucket_of(game, game->object[i].x, game->object[i].y);
+
+    while (*p != MAZE_OBJECT_NONE && *p != i)
+        p = &game->object_next[*p];
+    if (*p == i)
+        *p = game->object_next[i];
 }
 
-static void maze_menu_add_item(char *text, enum maze_program_state_t next_state, unsigned char cookie)
+static void maze_object_index_rebuild(struct maze_game *game)
 {
     int i;
 
-    if (maze_menu.nitems >= ARRAYSIZE(maze_menu.item))
+    BUILD_ASSERT(MAX_MAZE_OBJECTS < MAZE_OBJECT_NONE);
+    memset(game->object_bucket, MAZE_OBJECT_NONE, sizeof(game->object_bucket));
+    for (i = MAX_MAZE_OBJECTS - 1; i >= 0; i--)
+        if (game->object[i].x != 0)
+            maze_object_index_add(game, i);
+}
+
+/* Moves object i to x, y (or into the pocket, etc.) keeping the index up to date */
+static void maze_object_set_location(struct maze_game *game, int i, int x, int y)
+{
+    if (game->object[i].x != 0)
+        maze_object_index_remove(game, i);
+    game->object[i].x = x;
+    game->object[i].y = y;
+    if (x != 0)
+        maze_object_index_add(game, i);
+}
+
+static void maze_object_to_pocket(struct maze_game *game, int i)
+{
+    maze_object_set_location(game, i, MAZE_OBJECT_IN_POCKET, 0);
+}
+
+/* Returns the first object at x, y, or MAZE_OBJECT_NONE */
+static int maze_object_first_at(struct maze_game *game, int x, int y)
+{
+    int i = *maze_object_bucket_of(game, x, y);
+
+    while (i != MAZE_OBJECT_NONE && (game->object[i].x != x || game->object[i].y != y))
+        i = game->object_next[i];
+    return i;
+}
+
+/* Returns the next object at the same location as object i, or MAZE_OBJECT_NONE */
+static int maze_object_next_at(struct maze_game *game, int i)
+{
+    int j = game->object_next[i];
+
+    while (j != MAZE_OBJECT_NONE && (game->object[j].x != game->object[i].x || game->object[j].y != game->object[i].y))
+        j = game->object_next[j];
+    return j;
+}
+
+/* Fills list[] with the objects in the player's pocket and those at x, y, in
+ * object order, and returns how many there are.
+ */
+static int maze_objects_at_hand(struct maze_game *game, int x, int y, unsigned char list[])
+{
+    int a, b, n = 0;
+
+    a = maze_object_first_at(game, MAZE_OBJECT_IN_POCKET, 0);
+    b = maze_object_first_at(game, x, y);
+    while (a != MAZE_OBJECT_NONE || b != MAZE_OBJECT_NONE) {
+        if (b == MAZE_OBJECT_NONE || (a != MAZE_OBJECT_NONE && a < b)) {
+            list[n++] = a;
+            a = maze_object_next_at(game, a);
+        } else {
+            list[n++] = b;
+            b = maze_object_next_at(game, b);
+        }
+    }
+    return n;
+}
+
+#define MAZE_GEN_BUSY 0
+#define MAZE_GEN_DONE 1
+#define MAZE_GEN_START_OVER 2
+
+static void maze_menu_clear(struct maze_game *game)
+{
+    game->menu.title[0] = '\0';
+    game->menu.title2[0] = '\0';
+    game->menu.title3[0] = '\0';
+    game->menu.nitems = 0;
+    game->menu.current_item = 0;
+    game->menu.menu_active = 0;
+    game->menu.chosen_cookie = 0;
+}
+
+static void maze_menu_add_item(struct maze_game *game, char *text, enum maze_program_state_t next_state, unsigned char cookie)
+{
+    int i, j;
+
+    if (game->menu.nitems >= ARRAYSIZE(game->menu.item))
         return;
 
-    i = maze_menu.nitems;
-    strncpy(maze_menu.item[i].text, text, sizeof(maze_menu.item[i].text) - 1);
-    maze_menu.item[i].next_state = next_state;
-    maze_menu.item[i].cookie = cookie;
-    maze_menu.nitems++;
+    i = game->menu.nitems;
+    /* Labels too long for the menu are cut short */
+    for (j = 0; text[j] && j < (int) sizeof(game->menu.item[i].text) - 1; j++)
+        game->menu.item[i].text[j] = text[j];
+    game->menu.item[i].text[j] = '\0';
+    game->menu.item[i].next_state = next_state;
+    game->menu.item[i].cookie = cookie;
+    game->menu.nitems++;
 }
 
 static int min_maze_size(void)
 {
-    return XDIM * YDIM / 3;
+    return maze_xdim * maze_ydim / 3;
 }
 
 /* X and Y offsets for 8 cardinal directions: N, NE, E, SE, S, SW, W, NW */
 static const char xoff[] = { 0, 1, 1, 1, 0, -1, -1, -1 };
 static const char yoff[] = { -1, -1, 0, 1, 1, 1, 0, -1 };
 
-static void maze_stack_push(unsigned char x, unsigned char y, unsigned char direction)
+/* Makes room for at least one more stack entry, returns 0 if it can't */
+static int maze_stack_grow(struct maze_generator *g)
 {
-    maze_stack_ptr++;
-    if (maze_stack_ptr > 0 && maze_stack_ptr >= (ARRAYSIZE(maze_stack))) {
-        /* Oops, we blew our stack.  Start over */
 #ifdef __linux__
-        printf("Oops, stack blew... size = %d\n", maze_stack_ptr);
+    struct maze_gen_stack_element *new_stack;
+    int new_size = g->stack_size ? g->stack_size * 2 : MAZE_STACK_SIZE;
+
+    new_stack = realloc(g->stack, sizeof(*g->stack) * new_size);
+    if (!new_stack)
+        return 0;
+    g->stack = new_stack;
+    g->stack_size = new_size;
+    return 1;
+#else
+    if (g->stack) /* only one generator on the badge */
+        return 0;
+    g->stack = maze_stack_storage;
+    g->stack_size = ARRAYSIZE(maze_stack_storage);
+    return 1;
 #endif
-        maze_program_state = MAZE_LEVEL_INIT;
-        maze_random_seed[maze_current_level] = xorshift(&xorshift_state);
-        return;
-    }
-    if (max_maze_stack_depth < maze_stack_ptr)
-        max_maze_stack_depth = maze_stack_ptr;
-    maze_stack[maze_stack_ptr].x = x;
-    maze_stack[maze_stack_ptr].y = y;
-    maze_stack[maze_stack_ptr].direction = direction;
 }
 
-static void maze_stack_pop(void)
+/* Note: may move the stack, so pointers into it are stale afterwards */
+static void maze_stack_push(struct maze_generator *g, int x, int y, unsigned char direction)
 {
-    maze_stack_ptr--;
+    int i;
+
+    g->stack_ptr++;
+    if (g->stack_ptr >= g->stack_size && !maze_stack_grow(g)) {
+        /* Out of room, forget the oldest entry rather than starting over */
+#ifdef MAZE_DEBUG_PRINTS
+        printf("Stack full, dropping oldest entry... size = %d\n", g->stack_ptr);
+#endif
+        for (i = 1; i < g->stack_size; i++)
+            g->stack[i - 1] = g->stack[i];
+        g->stack_ptr--;
+        g->dropped_stack_entries++;
+    }
+    if (g->max_stack_depth < g->stack_ptr)
+        g->max_stack_depth = g->stack_ptr;
+    g->stack[g->stack_ptr].x = x;
+    g->stack[g->stack_ptr].y = y;
+    g->stack[g->stack_ptr].direction = direction;
 }
 
-static void player_init()
+static void maze_stack_pop(struct maze_generator *g)
 {
-    player.hitpoints = 255;
-    player.gp = 0;
-    player.weapon = 255;
-    player.armor = 255;
+    g->stack_ptr--;
 }
 
-static void init_maze_objects(void)
+static void player_init(struct maze_game *game)
 {
-    int i;
-
-    if (maze_previous_level == -1) { /* game is just beginning */
-        nmaze_objects = 0;
-        memset(maze_object, 0, sizeof(maze_object));
-        return;
-    }
-    /* zero out all objects not in player's possession */
-    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
-        if (maze_object[i].x != 255)
-            memset(&maze_object[i], 0, sizeof(maze_object[i]));
+    game->player.hitpoints = 255;
+    game->player.gp = 0;
+    game->player.weapon = 255;
+    game->player.armor = 255;
 }
 
-/* Initial program state to kick off maze generation */
-static void maze_init(void)
+static int maze_bit(const maze_word *bitmap, int x, int y)
 {
-    FbInit();
-    xorshift_state = maze_random_seed[maze_current_level];
-    if (xorshift_state == 0)
-        xorshift_state = 0xa5a5a5a5;
-    player.x = XDIM / 2;
-    player.y = YDIM - 2;
-    player.direction = 0;
-    max_maze_stack_depth = 0;
-    memset(maze, 0, sizeof(maze));
-    memset(maze_visited, 0, sizeof(maze_visited));
-    maze_stack_ptr = MAZE_STACK_EMPTY;
-    maze_stack_push(player.x, player.y, player.direction);
-    maze_program_state = MAZE_BUILD;
-    maze_size = 0;
-    init_maze_objects();
-    combat_mode = 0;
-    generation_iterations = 0;
+    return (bitmap[MAZE_WORD(x, y)] >> MAZE_SHIFT(x)) & 1;
 }
 
 /* Returns 1 if (x,y) is empty passage, 0 if solid rock */
-static unsigned char is_passage(unsigned char x, unsigned char y)
+static unsigned char is_passage(struct maze_game *game, int x, int y)
 {
-    return maze[x >> 3][y] & (1 << (x % 8));
+    return maze_bit(game->maze, x, y);
 }
 
 /* Sets maze square at x,y to 1 (empty passage) */
-static void dig_maze_square(unsigned char x, unsigned char y)
+static void dig_maze_square(struct maze_generator *g, int x, int y)
 {
-    unsigned char bit = 1 << (x % 8);
-    x = x >> 3;
-    maze[x][y] |= bit;
-    maze_size++;
+    g->maze[MAZE_WORD(x, y)] |= MAZE_BIT(x);
+    g->maze_size++;
 }
 
-static void mark_maze_square_visited(unsigned char x, unsigned char y)
+static void mark_maze_square_visited(struct maze_game *game, int x, int y)
 {
-    unsigned char bit = 1 << (x % 8);
-    x = x >> 3;
-    maze_visited[x][y] |= bit;
+    game->visited[MAZE_WORD(x, y)] |= MAZE_BIT(x);
 }
 
-static int is_visited(unsigned char x, unsigned char y)
+static int is_visited(struct maze_game *game, int x, int y)
 {
-    return maze_visited[x >> 3][y] & (1 << (x % 8));
+    return maze_bit(game->visited, x, y);
 }
 
 /* Returns 0 if x,y are in bounds of maze dimensions, 1 otherwise */
 static int out_of_bounds(int x, int y)
 {
-    if (x < XDIM && y < YDIM && x >= 0 && y >= 0)
+    if (x < maze_xdim && y < maze_ydim && x >= 0 && y >= 0)
         return 0;
     return 1;
 }
@@ -500,46 +821,63 @@ static unsigned char right_dir(int direction)
     return normalize_direction(direction + 2);
 }
 
-/* Consider whether digx, digy is diggable.  */
-static int diggable(unsigned char digx, unsigned char digy, unsigned char direction)
-{
-    int i, startdir, enddir;
-
-    if (out_of_bounds(digx, digy)) /* not diggable if out of bounds */
-        return 0;
+/* For each direction, the squares around the one being dug which must be solid
+ * rock: the three ahead and the two beside it (direction - 2 through direction + 2).
+ * Bit (dy + 1) * 3 + (dx + 1) stands for the neighbour at dx, dy, as in
+ * maze_neighbourhood().
+ */
+static const unsigned short dig_forbidden_mask[] = {
+    0x02f, 0x127, 0x1a6, 0x1e4, 0x1e8, 0x1c9, 0x0cb, 0x04f,
+};
 
+/* Returns the bits of the squares x - 1, x, x + 1 in a row of the maze as bits 0-2
+ * (square x - 1 is bit x of the row, because of the guard border)
+ */
+static unsigned int maze_row_bits(const maze_word *row, int x)
+{
+    int w = x / MAZE_WORD_BITS;
+    int shift = x % MAZE_WORD_BITS;
+    maze_word bits = row[w] >> shift;
 
-    startdir = left_dir(direction);
-    enddir = normalize_direction(right_dir(direction) + 1);
+    if (shift > MAZE_WORD_BITS - 3) /* straddles two words */
+        bits |= row[w + 1] << (MAZE_WORD_BITS - shift);
+    return bits & 0x07;
+}
 
-    i = startdir;
-    while (i != enddir) {
-        unsigned char x, y;
+/* Returns the 3x3 block of squares centered on x, y as a 9 bit mask, row by row.
+ * x, y must be in bounds, the guard border supplies the squares just outside.
+ */
+static unsigned int maze_neighbourhood(struct maze_generator *g, int x, int y)
+{
+    const maze_word *row = &g->maze[(y + 1) * maze_row_words];
 
-        x = digx + xoff[i];
-        y = digy + yoff[i];
+    return maze_row_bits(row - maze_row_words, x) |
+        (maze_row_bits(row, x) << 3) |
+        (maze_row_bits(row + maze_row_words, x) << 6);
+}
 
-        if (out_of_bounds(x, y)) /* We do not dig at the edge of the maze */
-            return 0;
-        if (is_passage(x, y)) /* do not connect to other passages */
-            return 0;
-        i = normalize_direction(i + 1);
-    }
-    return 1;
+/* Consider whether digx, digy is diggable.  Not if it is out of bounds, at the
+ * edge of the maze, or would connect to other passages.
+ */
+static int diggable(struct maze_generator *g, int digx, int digy, unsigned char direction)
+{
+    if (out_of_bounds(digx, digy)) /* not diggable if out of bounds */
+        return 0;
+    return (maze_neighbourhood(g, digx, digy) & dig_forbidden_mask[direction]) == 0;
 }
 
 /* Rolls the dice and returns 1 chance percent of the time
  * e.g. random_chance(80) returns 1 80% of the time, and 0
  * 20% of the time
  */
-static int random_choice(int chance)
+static int random_choice(struct maze_generator *g, int chance)
 {
-    return (xorshift(&xorshift_state) % 10000) < 100 * chance;
+    return (xorshift(&g->xorshift_state) % 10000) < 100 * chance;
 }
 
-static int object_is_portable(int i)
+static int object_is_portable(struct maze_game *game, int i)
 {
-    switch(maze_object_template[maze_object[i].type].category) {
+    switch(maze_object_template[game->object[i].type].category) {
     case MAZE_OBJECT_WEAPON:
     case MAZE_OBJECT_KEY:
     case MAZE_OBJECT_POTION:
@@ -554,31 +892,32 @@ static int object_is_portable(int i)
     }
 }
 
-static int something_here(int x, int y)
+/* The generator's objects aren't in the location index, but there are few of them */
+static int something_here(struct maze_generator *g, int x, int y)
 {
     int i;
 
-    for (i = 0; i < nmaze_objects; i++)
-        if (maze_object[i].x == x && maze_object[i].y == y)
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
+        if (g->object[i].x == x && g->object[i].y == y)
             return 1;
     return 0;
 }
 
-static void add_ladder(int ladder_type)
+static void add_ladder(struct maze_generator *g, int ladder_type)
 {
     int i, x, y;
 
     do {
-        x = xorshift(&xorshift_state) % XDIM;
-        y = xorshift(&xorshift_state) % YDIM;
-    } while (!is_passage(x, y) || something_here(x, y));
+        x = xorshift(&g->xorshift_state) % maze_xdim;
+        y = xorshift(&g->xorshift_state) % maze_ydim;
+    } while (!maze_bit(g->maze, x, y) || something_here(g, x, y));
 
-    if (nmaze_objects < MAX_MAZE_OBJECTS - 1) {
-        i = nmaze_objects;
+    if (g->nobjects < MAX_MAZE_OBJECTS - 1) {
+        i = g->nobjects;
     } else {
         for (i = 0; i < MAX_MAZE_OBJECTS; i++) {
-            if (maze_object[i].x != 255 &&
-                maze_object[i].type != DOWN_LADDER && maze_object[i].type != UP_LADDER)
+            if (g->object[i].x != MAZE_OBJECT_IN_POCKET &&
+                g->object[i].type != DOWN_LADDER && g->object[i].type != UP_LADDER)
                 break;
         }
     }
@@ -586,126 +925,127 @@ static void add_ladder(int ladder_type)
         /* now what? */
     }
 
-    maze_object[i].x = x;
-    maze_object[i].y = y;
-    maze_object[i].type = ladder_type;
+    g->object[i].x = x;
+    g->object[i].y = y;
+    g->object[i].type = ladder_type;
 
-    if ((maze_player_initial_placement == MAZE_PLACE_PLAYER_BENEATH_UP_LADDER &&
+    if ((g->req.placement == MAZE_PLACE_PLAYER_BENEATH_UP_LADDER &&
         ladder_type == UP_LADDER) ||
-        (maze_player_initial_placement == MAZE_PLACE_PLAYER_ABOVE_DOWN_LADDER &&
+        (g->req.placement == MAZE_PLACE_PLAYER_ABOVE_DOWN_LADDER &&
         ladder_type == DOWN_LADDER)) {
-        player.x = x;
-        player.y = y;
+        g->player_x = x;
+        g->player_y = y;
     }
 
-    if (i >= nmaze_objects - 1)
-        nmaze_objects = i + 1;
+    if (i >= g->nobjects - 1)
+        g->nobjects = i + 1;
 }
 
-static void add_ladders(int level)
+static void add_ladders(struct maze_generator *g, int level)
 {
     if (level < NLEVELS - 1)
-        add_ladder(DOWN_LADDER);
-    add_ladder(UP_LADDER);
+        add_ladder(g, DOWN_LADDER);
+    add_ladder(g, UP_LADDER);
 }
 
-static void add_chalice(int level)
+static void add_chalice(struct maze_generator *g, int level)
 {
     int i, x, y;
     if (level < NLEVELS - 1) {
-#ifdef __linux__
+#ifdef MAZE_DEBUG_PRINTS
         printf("Not adding chalice, level = %d < %d\n", level, NLEVELS - 1);
 #endif
         return; /* chalice is only on deepest level */
     }
 
     do {
-        x = xorshift(&xorshift_state) % XDIM;
-        y = xorshift(&xorshift_state) % YDIM;
-    } while (!is_passage(x, y) || something_here(x, y) || (x == player.x && y == player.y));
+        x = xorshift(&g->xorshift_state) % maze_xdim;
+        y = xorshift(&g->xorshift_state) % maze_ydim;
+    } while (!maze_bit(g->maze, x, y) || something_here(g, x, y) || (x == g->player_x && y == g->player_y));
 
-    if (nmaze_objects < MAX_MAZE_OBJECTS - 1) {
-        i = nmaze_objects;
+    if (g->nobjects < MAX_MAZE_OBJECTS - 1) {
+        i = g->nobjects;
     } else {
         for (i = 0; i < MAX_MAZE_OBJECTS; i++) {
-            if (maze_object[i].x != 255 &&
-                maze_object[i].type != DOWN_LADDER && maze_object[i].type != UP_LADDER)
+            if (g->object[i].x != MAZE_OBJECT_IN_POCKET &&
+                g->object[i].type != DOWN_LADDER && g->object[i].type != UP_LADDER)
                 break;
         }
     }
     if (i >= MAX_MAZE_OBJECTS) { /* Player somehow has all objects */
-#ifdef __linux__
+#ifdef MAZE_DEBUG_PRINTS
 	printf("Didn't add chalice.\n");
 #endif
         /* now what? */
     }
 
-    maze_object[i].x = x;
-    maze_object[i].y = y;
-    maze_object[i].type = CHALICE;
-#ifdef __linux__
+    g->object[i].x = x;
+    g->object[i].y = y;
+    g->object[i].type = CHALICE;
+#ifdef MAZE_DEBUG_PRINTS
 	printf("Added chalice, object %d at %d, %d, level %d\n", i, x, y, level);
 #endif
-    if (i >= nmaze_objects - 1) {
-        nmaze_objects = i + 1;
-#ifdef __linux__
+    if (i >= g->nobjects - 1) {
+        g->nobjects = i + 1;
+#ifdef MAZE_DEBUG_PRINTS
 	printf("Added new object for chalice\n");
 #endif
     }
 }
 
-static void add_random_object(int x, int y)
+static void add_random_object(struct maze_generator *g, int x, int y)
 {
     int otype, i;
 
     /* Find a free object */
     for (i = 0; i < MAX_MAZE_OBJECTS; i++)
-       if (maze_object[i].x == 0)
+       if (g->object[i].x == 0)
           break;
     if (i >= MAX_MAZE_OBJECTS)
         return;
 
-    maze_object[i].x = x;
-    maze_object[i].y = y;
-    otype = xorshift(&xorshift_state) % (nobject_types - 3); /* minus 3 to exclude ladders and chalice */
-    maze_object[i].type = otype;
-    switch(maze_object_template[maze_object[i].type].category) {
+    g->object[i].x = x;
+    g->object[i].y = y;
+    otype = xorshift(&g->xorshift_state) % (nobject_types - 3); /* minus 3 to exclude ladders and chalice */
+    g->object[i].type = otype;
+    switch(maze_object_template[g->object[i].type].category) {
     case MAZE_OBJECT_MONSTER:
-        maze_object[i].tsd.monster.hitpoints =
-            maze_object_template[otype].hitpoints + (xorshift(&xorshift_state) % 5);
-        maze_object[i].tsd.monster.speed =
-            maze_object_template[maze_object[i].type].speed;
+        g->object[i].tsd.monster.hitpoints =
+            maze_object_template[otype].hitpoints + (xorshift(&g->xorshift_state) % 5);
+        g->object[i].tsd.monster.speed =
+            maze_object_template[g->object[i].type].speed;
         break;
     case MAZE_OBJECT_POTION:
-        maze_object[i].tsd.potion.type = (xorshift(&xorshift_state) % ARRAYSIZE(potion_type));
+        g->object[i].tsd.potion.type = (xorshift(&g->xorshift_state) % ARRAYSIZE(potion_type));
         break;
     case MAZE_OBJECT_ARMOR:
-        maze_object[i].tsd.armor.type = (xorshift(&xorshift_state) % ARRAYSIZE(armor_type));
+        g->object[i].tsd.armor.type = (xorshift(&g->xorshift_state) % ARRAYSIZE(armor_type));
         break;
     case MAZE_OBJECT_TREASURE:
-        maze_object[i].tsd.treasure.gp = (xorshift(&xorshift_state) % 40);
+        g->object[i].tsd.treasure.gp = (xorshift(&g->xorshift_state) % 40);
         break;
     case MAZE_OBJECT_WEAPON:
-        maze_object[i].tsd.weapon.type = (xorshift(&xorshift_state) % ARRAYSIZE(weapon_type));
+        g->object[i].tsd.weapon.type = (xorshift(&g->xorshift_state) % ARRAYSIZE(weapon_type));
         break;
     case MAZE_OBJECT_SCROLL:
     case MAZE_OBJECT_GRENADE:
     default:
         break;
     }
-    if (i > nmaze_objects - 1)
-        nmaze_objects = i + 1;
+    if (i > g->nobjects - 1)
+        g->nobjects = i + 1;
 }
 
-static void print_maze()
+static void print_maze(struct maze_game *game)
 {
-#ifdef __linux__
+#ifdef MAZE_DEBUG_PRINTS
     int i, j;
 
-    for (j = 0; j < YDIM; j++) {
-        for (i = 0; i < XDIM; i++) {
-            if (is_passage(i, j))
-                if (j == player.y && i == player.x)
+    /* Huge mazes would just scroll by for ages */
+    for (j = 0; j < maze_ydim && maze_xdim <= 256; j++) {
+        for (i = 0; i < maze_xdim; i++) {
+            if (is_passage(game, i, j))
+                if (j == game->player.y && i == game->player.x)
                     printf("@");
                 else
                     printf(" ");
@@ -714,183 +1054,650 @@ static void print_maze()
         }
         printf("\n");
     }
-    printf("maze_size = %d, max stack depth = %d, generation_iterations = %d\n", maze_size, max_maze_stack_depth, generation_iterations);
+    printf("maze_size = %d, max stack depth = %d, generation_iterations = %d\n", game->maze_size, game->max_stack_depth, game->generation_iterations);
 #endif
-    maze_program_state = MAZE_RENDER;
+    game->state = MAZE_RENDER;
 }
 
-/* Normally this would be recursive, but instead we use an explicit stack
- * to enable this to yield and then restart as needed.
+/* Initial state to kick off generating a level into g, which must have its
+ * request, seed and bitmaps set up.
+ */
+static void maze_gen_start(struct maze_generator *g, int nobjects)
+{
+    int i;
+
+    g->xorshift_state = g->seed;
+    if (g->xorshift_state == 0)
+        g->xorshift_state = 0xa5a5a5a5;
+    g->player_x = maze_xdim / 2;
+    g->player_y = maze_ydim - 2;
+    g->max_stack_depth = 0;
+    maze_clear_bitmaps(g->maze, g->visited);
+    g->stack_ptr = MAZE_STACK_EMPTY;
+    maze_stack_push(g, g->player_x, g->player_y, 0);
+    g->maze_size = 0;
+    g->iterations = 0;
+    /* Objects in the player's pocket keep their slots, the rest are free */
+    memset(g->object, 0, sizeof(g->object));
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
+        if (g->req.pocket & (1U << i))
+            g->object[i].x = MAZE_OBJECT_IN_POCKET;
+    g->nobjects = nobjects;
+}
+
+/* Called when the stack runs out.  Either the maze is big enough and gets its
+ * ladders and chalice, or it must be started over with a new seed.
  */
-static void generate_maze(void)
+static int maze_gen_finish(struct maze_generator *g)
 {
-    static int counter = 0;
-    unsigned char *x, *y, *d;
-    unsigned char nx, ny;
+    if (g->maze_size < min_maze_size()) {
+#ifdef MAZE_DEBUG_PRINTS
+        printf("maze too small, starting over\n");
+#endif
+        g->too_small_restarts++;
+        g->seed = xorshift(&g->xorshift_state);
+        return MAZE_GEN_START_OVER;
+    }
+    add_ladders(g, g->req.level);
+    add_chalice(g, g->req.level);
+    return MAZE_GEN_DONE;
+}
 
-    BUILD_ASSERT((XDIM % 8) == 0); /* This is a build-time assertion that generates no code */
+/* Normally this would be recursive, but instead we use an explicit stack
+ * to enable this to yield and then restart as needed.  Returns MAZE_GEN_BUSY
+ * until the level is done, or MAZE_GEN_START_OVER if it must be started over
+ * from g->seed.
+ */
+static int generate_maze(struct maze_generator *g)
+{
+    unsigned short *x, *y;
+    unsigned char *d;
+    int nx, ny;
 
-    x = &maze_stack[maze_stack_ptr].x;
-    y = &maze_stack[maze_stack_ptr].y;
-    d = &maze_stack[maze_stack_ptr].direction;
+    x = &g->stack[g->stack_ptr].x;
+    y = &g->stack[g->stack_ptr].y;
+    d = &g->stack[g->stack_ptr].direction;
 
-    counter++;
-    generation_iterations++;
+    g->iterations++;
 
-    dig_maze_square(*x, *y);
+    dig_maze_square(g, *x, *y);
 
-    if (random_choice(OBJECT_CHANCE))
-        add_random_object(*x, *y);
+    if (random_choice(g, OBJECT_CHANCE))
+        add_random_object(g, *x, *y);
     nx = *x + xoff[*d];
     ny = *y + yoff[*d];
-    if (!diggable(nx, ny, *d))
-        maze_stack_pop();
-    if (maze_stack_ptr == MAZE_STACK_EMPTY) {
-        maze_program_state = MAZE_PRINT;
-        if (maze_size < min_maze_size()) {
-#ifdef __linux
-            printf("maze too small, starting over\n");
-#endif
-            maze_program_state = MAZE_LEVEL_INIT;
-            maze_random_seed[maze_current_level] = xorshift(&xorshift_state);
-        } else {
-            add_ladders(maze_current_level);
-            add_chalice(maze_current_level);
-        }
-        return;
-    }
+    if (!diggable(g, nx, ny, *d))
+        maze_stack_pop(g);
+    if (g->stack_ptr == MAZE_STACK_EMPTY)
+        return maze_gen_finish(g);
     *x = nx;
     *y = ny;
-    if (random_choice(TERMINATE_CHANCE)) {
-        maze_stack_pop();
-        if (maze_stack_ptr == MAZE_STACK_EMPTY) {
-            maze_program_state = MAZE_PRINT;
-            if (maze_size < min_maze_size()) {
-#ifdef __linux
-                printf("maze too small, starting over\n");
-#endif
-                maze_program_state = MAZE_LEVEL_INIT;
-                maze_random_seed[maze_current_level] = xorshift(&xorshift_state);
-            } else {
-                add_ladders(maze_current_level);
-                add_chalice(maze_current_level);
-            }
-            return;
-        }
+    if (random_choice(g, TERMINATE_CHANCE)) {
+        maze_stack_pop(g);
+        if (g->stack_ptr == MAZE_STACK_EMPTY)
+            return maze_gen_finish(g);
     }
-    if (random_choice(BRANCH_CHANCE)) {
-        int new_dir = random_choice(50) ? right_dir(*d) : left_dir(*d);
-        if (diggable(xoff[new_dir] + nx, yoff[new_dir] + ny, new_dir))
-            maze_stack_push(nx, ny, (unsigned char) new_dir);
+    if (random_choice(g, BRANCH_CHANCE)) {
+        int new_dir = random_choice(g, 50) ? right_dir(*d) : left_dir(*d);
+        if (diggable(g, xoff[new_dir] + nx, yoff[new_dir] + ny, new_dir))
+            maze_stack_push(g, nx, ny, (unsigned char) new_dir);
     }
+    return MAZE_GEN_BUSY;
 }
 
-static void draw_map()
+/* Fills in a request for generating level from the state of the game */
+static void maze_gen_request_init(struct maze_game *game, struct maze_gen_request *r, int level, int placement)
 {
-    int x, y;
+    int i;
 
-    FbClear();
-    FbColor(GREEN);
-    for (x = 0; x < XDIM; x++) {
-        for (y = 0; y < YDIM; y++) {
-            if (x == player.x && y == player.y) {
-                FbColor(WHITE);
-                FbLine(x * 3 - 2, y * 3 - 2, x * 3 + 2, y * 3 - 2);
-                FbLine(x * 3 - 2, y * 3 - 1, x * 3 + 2, y * 3 - 1);
-                FbLine(x * 3 - 2, y * 3 - 0, x * 3 + 2, y * 3 - 0);
-                FbLine(x * 3 - 2, y * 3 + 1, x * 3 + 2, y * 3 + 1);
-                FbLine(x * 3 - 2, y * 3 + 2, x * 3 + 2, y * 3 + 2);
-                FbColor(GREEN);
-                continue;
-            }
-            if (is_visited(x, y)) {
-                FbHorizontalLine(x * 3 - 1, y * 3 - 1, x * 3 + 1, y * 3 - 1);
-                FbHorizontalLine(x * 3 - 1, y * 3, x * 3 + 1, y * 3);
-                FbHorizontalLine(x * 3 - 1, y * 3 + 1, x * 3 + 1, y * 3 + 1);
-            }
-       }
-    }
-    maze_program_state = MAZE_SCREEN_RENDER;
+    BUILD_ASSERT(MAX_MAZE_OBJECTS <= 32); /* pocket is a bitmask */
+    r->level = level;
+    r->seed = game->random_seed[level];
+    r->placement = placement;
+    r->nobjects = 0;
+    r->pocket = 0;
+    /* When the game is just beginning the pocket is emptied, but the player
+     * arrives at any other level with everything they have now.
+     */
+    if (game->previous_level == -1 && level == game->current_level)
+        return;
+    r->nobjects = game->nobjects;
+    for (i = maze_object_first_at(game, MAZE_OBJECT_IN_POCKET, 0); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i))
+        r->pocket |= 1U << i;
 }
 
-/* These integer ratios approximate 0.4, 0.4 * 0.8, 0.4 * 0.8^2, 0.4 * 0.8^3, 0.4 * 0.8^4, ...
- * which are used to approximate appropriate perspective scaling (reduction in size as viewing
- * distance linearly increases stepwise) while avoiding floating point operations.
- *
- * The denominator is always 1024.
+/* Makes the level built by g the one being played.  The bitmaps are swapped
+ * rather than copied, g gets the old ones to build its next level in.
  */
-static const int drawing_scale_numerator[] = { 410, 328, 262, 210, 168, 134, 107, 86 };
-
-static void draw_object(struct point drawing[], int npoints, int scale_index, int color, int x, int y)
+static void maze_gen_install(struct maze_game *game, struct maze_generator *g)
 {
+    maze_word *old_maze = game->maze, *old_visited = game->visited;
     int i;
-    int xcenter = x;
-    int ycenter = y;
-    int num;
 
-    num = drawing_scale_numerator[scale_index];
+    game->maze = g->maze;
+    game->visited = g->visited;
+    g->maze = old_maze;
+    g->visited = old_visited;
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
+        if (!(g->req.pocket & (1U << i)))
+            game->object[i] = g->object[i];
+    game->nobjects = g->nobjects;
+    maze_object_index_rebuild(game);
+    game->player.x = g->player_x;
+    game->player.y = g->player_y;
+    game->xorshift_state = g->xorshift_state; /* carry on with the level's random numbers */
+    game->random_seed[g->req.level] = g->seed;
+    game->maze_size = g->maze_size;
+    game->max_stack_depth = g->max_stack_depth;
+    game->generation_iterations = g->iterations;
+}
 
-    FbColor(color);
-    for (i = 0; i < npoints - 1;) {
-        if (drawing[i].x == -128) {
-            i++;
-            continue;
-        }
-        if (drawing[i + 1].x == -128) {
-            i+=2;
-            continue;
+#ifdef MAZE_PREGENERATE
+/* Worker threads generate the levels the player could go to next, so that
+ * taking a ladder is a swap of bitmaps rather than a rebuild.  Each game has a
+ * slot per level.  maze_pregen_request() says what the slot should hold and
+ * queues it, workers (shared by all games) build it, and maze_pregen_take()
+ * installs it if it still matches what the game would have generated.  If not,
+ * or it isn't ready, the level is generated the usual way.
+ */
+#define MAZE_PREGEN_THREADS 2
+
+#define MAZE_PREGEN_IDLE 0
+#define MAZE_PREGEN_QUEUED 1
+#define MAZE_PREGEN_BUSY 2
+#define MAZE_PREGEN_DONE 3
+#define MAZE_PREGEN_FAILED 4
+
+static int maze_gen_request_equal(const struct maze_gen_request *a, const struct maze_gen_request *b)
+{
+    return a->level == b->level && a->seed == b->seed && a->placement == b->placement &&
+        a->nobjects == b->nobjects && a->pocket == b->pocket;
+}
+
+static pthread_mutex_t maze_pregen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maze_pregen_cond = PTHREAD_COND_INITIALIZER; /* something was queued */
+static pthread_cond_t maze_pregen_built_cond = PTHREAD_COND_INITIALIZER; /* a slot stopped being BUSY */
+static pthread_once_t maze_pregen_once = PTHREAD_ONCE_INIT;
+static struct maze_pregen_slot *maze_pregen_queue = NULL; /* QUEUED slots, oldest first */
+static struct maze_pregen_slot **maze_pregen_queue_tail = &maze_pregen_queue;
+
+/* Call with maze_pregen_mutex held */
+static void maze_pregen_enqueue(struct maze_pregen_slot *s)
+{
+    s->state = MAZE_PREGEN_QUEUED;
+    s->next = NULL;
+    *maze_pregen_queue_tail = s;
+    maze_pregen_queue_tail = &s->next;
+    pthread_cond_signal(&maze_pregen_cond);
+}
+
+/* Call with maze_pregen_mutex held */
+static void maze_pregen_dequeue(struct maze_pregen_slot *s)
+{
+    struct maze_pregen_slot **p;
+
+    for (p = &maze_pregen_queue; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            if (!*p)
+                maze_pregen_queue_tail = p;
+            return;
         }
-        FbLine(xcenter + ((drawing[i].x * num) >> 10), ycenter + ((drawing[i].y * num) >> 10),
-            xcenter + ((drawing[i + 1].x * num) >> 10), ycenter + ((drawing[i + 1].y * num) >> 10));
-        i++;
     }
 }
 
-static void draw_left_passage(int start, int scale)
+/* Runs a generator to completion, returns 0 if its bitmaps can't be allocated */
+static int maze_pregen_build(struct maze_generator *g)
 {
-    FbVerticalLine(start, start, start, SCREEN_YDIM - 1 - start);
-    FbVerticalLine(start + scale, start + scale, start + scale, SCREEN_YDIM - 1 - (start + scale));
-    FbHorizontalLine(start, start + scale, start + scale, start + scale);
-    FbHorizontalLine(start, SCREEN_YDIM - 1 - (start + scale), start + scale, SCREEN_YDIM - 1 - (start + scale));
+    int rc;
+
+    if (!g->maze) {
+        g->maze = malloc(sizeof(*g->maze) * MAZE_BITMAP_WORDS);
+        g->visited = malloc(sizeof(*g->visited) * MAZE_BITMAP_WORDS);
+        if (!g->maze || !g->visited) {
+            free(g->maze);
+            free(g->visited);
+            g->maze = g->visited = NULL;
+            return 0;
+        }
+    }
+    g->seed = g->req.seed;
+    maze_gen_start(g, g->req.nobjects);
+    do {
+        rc = generate_maze(g);
+        if (rc == MAZE_GEN_START_OVER)
+            maze_gen_start(g, g->nobjects); /* as maze_init() would, game->nobjects is not reset */
+    } while (rc != MAZE_GEN_DONE);
+    return 1;
 }
 
-static void draw_right_passage(int start, int scale)
+static void *maze_pregen_worker(__attribute__((unused)) void *arg)
 {
-    FbVerticalLine(SCREEN_XDIM - 1 - start, start, SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start);
-    FbVerticalLine(SCREEN_XDIM - 1 - start - scale, start + scale, SCREEN_XDIM - 1 - start - scale, SCREEN_YDIM - 1 - start - scale);
-    FbHorizontalLine(SCREEN_XDIM - 1 - (start + scale), start + scale, SCREEN_XDIM - 1 - start, start + scale);
-    FbHorizontalLine(SCREEN_XDIM - 1 - (start + scale), SCREEN_YDIM - 1 - (start + scale), SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - (start + scale));
+    struct maze_pregen_slot *s;
+    int ok;
+
+    pthread_mutex_lock(&maze_pregen_mutex);
+    for (;;) {
+        s = maze_pregen_queue;
+        if (!s) {
+            pthread_cond_wait(&maze_pregen_cond, &maze_pregen_mutex);
+            continue;
+        }
+        maze_pregen_dequeue(s);
+        s->state = MAZE_PREGEN_BUSY;
+        s->gen.req = s->want;
+        pthread_mutex_unlock(&maze_pregen_mutex);
+        ok = maze_pregen_build(&s->gen);
+        pthread_mutex_lock(&maze_pregen_mutex);
+        if (!ok)
+            s->state = MAZE_PREGEN_FAILED;
+        else if (maze_gen_request_equal(&s->want, &s->gen.req))
+            s->state = MAZE_PREGEN_DONE;
+        else
+            maze_pregen_enqueue(s); /* the game moved on while we were building */
+        pthread_cond_broadcast(&maze_pregen_built_cond);
+    }
+    return NULL;
 }
 
-static void draw_left_wall(int start, int scale)
+static void maze_pregen_start_threads(void)
 {
-    FbLine(start, start, start + scale, start + scale);
-    FbLine(start, SCREEN_YDIM - 1 - start, start + scale, SCREEN_YDIM - 1 - (start + scale));
+    pthread_t thr;
+    int i;
+
+    for (i = 0; i < MAZE_PREGEN_THREADS; i++) {
+        if (pthread_create(&thr, NULL, maze_pregen_worker, NULL) != 0) {
+#ifdef MAZE_DEBUG_PRINTS
+            printf("Failed to create level generation thread\n");
+#endif
+            return;
+        }
+        pthread_detach(thr);
+    }
 }
 
-static void draw_right_wall(int start, int scale)
+/* Asks for level to be generated in the background, as it would be if the
+ * player arrived there now with the given placement.
+ */
+static void maze_pregen_request(struct maze_game *game, int level, int placement)
 {
-    FbLine(SCREEN_XDIM - 1 - start, start, SCREEN_XDIM - 1 - (start + scale), start + scale);
-    FbLine(SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start, SCREEN_XDIM - 1 - (start + scale), SCREEN_YDIM - 1 - (start + scale));
+    struct maze_pregen_slot *s = &game->pregen_slot[level];
+    struct maze_gen_request r;
+
+    pthread_once(&maze_pregen_once, maze_pregen_start_threads); /* games on several threads may get here at once */
+    maze_gen_request_init(game, &r, level, placement);
+    pthread_mutex_lock(&maze_pregen_mutex);
+    s->want = r;
+    if (s->state == MAZE_PREGEN_IDLE || s->state == MAZE_PREGEN_FAILED ||
+        (s->state == MAZE_PREGEN_DONE && !maze_gen_request_equal(&s->gen.req, &r)))
+        maze_pregen_enqueue(s);
+    pthread_mutex_unlock(&maze_pregen_mutex);
 }
 
-static void draw_forward_wall(int start, int scale)
+/* Installs the pregenerated level for r if there is one, returns 1 if so */
+static int maze_pregen_take(struct maze_game *game, const struct maze_gen_request *r)
 {
-    FbVerticalLine(start, start, start, SCREEN_YDIM - 1 - start);
-    FbVerticalLine(SCREEN_XDIM - 1 - start, start, SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start);
-    FbHorizontalLine(start, start, SCREEN_XDIM - 1 - start, start);
-    FbHorizontalLine(start, SCREEN_YDIM - 1 - start, SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start);
+    struct maze_pregen_slot *s = &game->pregen_slot[r->level];
+    int ok;
+
+    pthread_mutex_lock(&maze_pregen_mutex);
+    ok = s->state == MAZE_PREGEN_DONE && maze_gen_request_equal(&s->gen.req, r);
+    if (ok) {
+        maze_gen_install(game, &s->gen);
+        s->state = MAZE_PREGEN_IDLE;
+    }
+    pthread_mutex_unlock(&maze_pregen_mutex);
+    return ok;
 }
 
-static char *encounter_text = "x";
-static char *encounter_adjective = "";
-static char *encounter_name = "";
-static unsigned char encounter_object = 255;
-
-/* Returns 1 if traversal of ladder successful.
- * Returns 0 if you cannot go that way.
+/* Takes game's slots off the queue, and waits for any being built, so the
+ * workers are done with them.
  */
-static int go_up_or_down(int direction)
+static void maze_pregen_cancel(struct maze_game *game)
+{
+    int i;
+
+    pthread_mutex_lock(&maze_pregen_mutex);
+    for (i = 0; i < NLEVELS; i++) {
+        while (game->pregen_slot[i].state == MAZE_PREGEN_BUSY)
+            pthread_cond_wait(&maze_pregen_built_cond, &maze_pregen_mutex);
+        if (game->pregen_slot[i].state == MAZE_PREGEN_QUEUED)
+            maze_pregen_dequeue(&game->pregen_slot[i]);
+        game->pregen_slot[i].state = MAZE_PREGEN_IDLE;
+    }
+    pthread_mutex_unlock(&maze_pregen_mutex);
+}
+#endif
+
+/* Levels the player has left are kept, so that going back to one finds it as it
+ * was left (dropped objects, dead monsters, the map) instead of regenerated.
+ * Bitmaps are swapped in and out rather than copied.  Objects are renumbered on
+ * the way back in, as the player may since have pocketed objects using the same
+ * slots (if too few slots are left, the last of them are lost).  When the
+ * cache is full the least recently left level is forgotten, and gets
+ * regenerated from its seed if the player goes back there.
+ */
+#ifndef __linux__
+static maze_word maze_level_cache_storage[MAZE_LEVEL_CACHE_ENTRIES][2][MAZE_MAX_ROW_WORDS * (MAZE_MAX_YDIM + 2)];
+#endif
+
+static void maze_level_cache_flush(struct maze_game *game)
+{
+    int i;
+
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++)
+        game->level_cache[i].in_use = 0;
+}
+
+/* Returns the cache entry holding level, or -1 */
+static int maze_level_cache_lookup(struct maze_game *game, int level)
+{
+    int i;
+
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++)
+        if (game->level_cache[i].in_use && game->level_cache[i].level == level)
+            return i;
+    return -1;
+}
+
+/* Makes sure e has bitmaps to swap with, returns 0 if it can't */
+static int maze_level_cache_alloc(struct maze_game *game, struct maze_level_cache_entry *e)
+{
+    if (e->maze)
+        return 1;
+#ifdef __linux__
+    e->maze = malloc(sizeof(*e->maze) * MAZE_BITMAP_WORDS);
+    e->visited = malloc(sizeof(*e->visited) * MAZE_BITMAP_WORDS);
+    if (!e->maze || !e->visited) {
+        free(e->maze);
+        free(e->visited);
+        e->maze = e->visited = NULL;
+        return 0;
+    }
+#else
+    e->maze = maze_level_cache_storage[e - game->level_cache][0];
+    e->visited = maze_level_cache_storage[e - game->level_cache][1];
+#endif
+    return 1;
+}
+
+/* Stashes the level being played, before the player leaves it */
+static void maze_level_cache_store(struct maze_game *game, int level)
+{
+    struct maze_level_cache_entry *e;
+    maze_word *m, *v;
+    int i;
+
+    i = maze_level_cache_lookup(game, level);
+    if (i >= 0) {
+        e = &game->level_cache[i];
+    } else { /* an unused entry, or else the least recently left level */
+        e = &game->level_cache[0];
+        for (i = 1; i < MAZE_LEVEL_CACHE_ENTRIES && e->in_use; i++)
+            if (!game->level_cache[i].in_use || game->level_cache[i].last_used < e->last_used)
+                e = &game->level_cache[i];
+    }
+    e->in_use = 0;
+    if (!maze_level_cache_alloc(game, e))
+        return;
+    m = e->maze;
+    v = e->visited;
+    e->maze = game->maze;
+    e->visited = game->visited;
+    game->maze = m;
+    game->visited = v;
+    e->nobjects = 0;
+    for (i = 0; i < game->nobjects; i++)
+        if (game->object[i].x != 0 && game->object[i].x < maze_xdim)
+            e->object[e->nobjects++] = game->object[i];
+    e->player_x = game->player.x;
+    e->player_y = game->player.y;
+    e->last_used = ++game->level_cache_clock;
+    e->level = level;
+    e->in_use = 1;
+}
+
+/* Puts back a level the player left earlier.  Returns 0 if it isn't cached. */
+static int maze_level_cache_restore(struct maze_game *game, int level)
+{
+    struct maze_level_cache_entry *e;
+    maze_word *m, *v;
+    int i, j, ladder_type;
+
+    i = maze_level_cache_lookup(game, level);
+    if (i < 0)
+        return 0;
+    e = &game->level_cache[i];
+    e->in_use = 0;
+    m = game->maze;
+    v = game->visited;
+    game->maze = e->maze;
+    game->visited = e->visited;
+    e->maze = m;
+    e->visited = v;
+
+    /* Fill the slots not in the player's pocket with the level's objects, in order */
+    j = 0;
+    game->nobjects = 0;
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++) {
+        if (game->object[i].x == MAZE_OBJECT_IN_POCKET) {
+            game->nobjects = i + 1;
+            continue;
+        }
+        if (j < e->nobjects) {
+            game->object[i] = e->object[j++];
+            game->nobjects = i + 1;
+        } else {
+            memset(&game->object[i], 0, sizeof(game->object[i]));
+        }
+    }
+    maze_object_index_rebuild(game);
+
+    game->player.x = e->player_x;
+    game->player.y = e->player_y;
+    ladder_type = -1;
+    if (game->player_initial_placement == MAZE_PLACE_PLAYER_BENEATH_UP_LADDER)
+        ladder_type = UP_LADDER;
+    else if (game->player_initial_placement == MAZE_PLACE_PLAYER_ABOVE_DOWN_LADDER)
+        ladder_type = DOWN_LADDER;
+    for (i = 0; i < game->nobjects; i++)
+        if (game->object[i].type == ladder_type && game->object[i].x < maze_xdim) {
+            game->player.x = game->object[i].x;
+            game->player.y = game->object[i].y;
+        }
+    return 1;
+}
+
+#ifdef MAZE_PREGENERATE
+/* Keeps the levels above and below the current one generated in the background,
+ * unless the player has been there and they are cached.
+ */
+static void maze_pregen_neighbours(struct maze_game *game)
+{
+    int above = game->current_level - 1, below = game->current_level + 1;
+
+    if (above >= 0 && maze_level_cache_lookup(game, above) < 0)
+        maze_pregen_request(game, above, MAZE_PLACE_PLAYER_ABOVE_DOWN_LADDER);
+    if (below < NLEVELS && maze_level_cache_lookup(game, below) < 0)
+        maze_pregen_request(game, below, MAZE_PLACE_PLAYER_BENEATH_UP_LADDER);
+}
+#endif
+
+/* Initial program state to kick off maze generation */
+static void maze_init(struct maze_game *game)
+{
+    struct maze_gen_request r;
+
+    FbInit();
+    game->player.direction = 0;
+    game->combat_mode = 0;
+    if (game->previous_level == -1) {
+        maze_level_cache_flush(game); /* new game */
+    } else if (maze_level_cache_restore(game, game->current_level)) {
+        game->state = MAZE_RENDER;
+        return;
+    }
+    maze_gen_request_init(game, &r, game->current_level, game->player_initial_placement);
+#ifdef MAZE_PREGENERATE
+    if (maze_pregen_take(game, &r)) {
+        game->state = MAZE_PRINT;
+        return;
+    }
+#endif
+    game->gen.req = r;
+    game->gen.seed = r.seed;
+    game->gen.maze = game->maze;
+    game->gen.visited = game->visited;
+    maze_gen_start(&game->gen, r.nobjects);
+    game->state = MAZE_BUILD;
+}
+
+/* Advances level generation one step */
+static void maze_build(struct maze_game *game)
+{
+    switch (generate_maze(&game->gen)) {
+    case MAZE_GEN_DONE:
+        maze_gen_install(game, &game->gen);
+        game->state = MAZE_PRINT;
+        break;
+    case MAZE_GEN_START_OVER:
+        game->random_seed[game->gen.req.level] = game->gen.seed;
+        if (game->previous_level != -1)
+            game->nobjects = game->gen.nobjects; /* as if objects had been added all along */
+        game->state = MAZE_LEVEL_INIT;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Map squares are drawn 3 pixels apart.  Mazes bigger than the screen only
+ * show the part around the player.
+ */
+#define MAZE_MAP_SQUARES (SCREEN_XDIM / 3)
+
+static int map_window_origin(int player_pos, int dim)
+{
+    int origin;
+
+    if (dim <= MAZE_MAP_SQUARES)
+        return 0;
+    origin = player_pos - MAZE_MAP_SQUARES / 2;
+    if (origin < 0)
+        origin = 0;
+    if (origin > dim - MAZE_MAP_SQUARES)
+        origin = dim - MAZE_MAP_SQUARES;
+    return origin;
+}
+
+static void draw_map(struct maze_game *game)
+{
+    int x, y, mx, my, x0, y0, x1, y1;
+
+    x0 = map_window_origin(game->player.x, maze_xdim);
+    y0 = map_window_origin(game->player.y, maze_ydim);
+    x1 = x0 + MAZE_MAP_SQUARES < maze_xdim ? x0 + MAZE_MAP_SQUARES : maze_xdim;
+    y1 = y0 + MAZE_MAP_SQUARES < maze_ydim ? y0 + MAZE_MAP_SQUARES : maze_ydim;
+
+    FbClear();
+    FbColor(GREEN);
+    for (mx = x0; mx < x1; mx++) {
+        for (my = y0; my < y1; my++) {
+            x = mx - x0;
+            y = my - y0;
+            if (mx == game->player.x && my == game->player.y) {
+                FbColor(WHITE);
+                FbLine(x * 3 - 2, y * 3 - 2, x * 3 + 2, y * 3 - 2);
+                FbLine(x * 3 - 2, y * 3 - 1, x * 3 + 2, y * 3 - 1);
+                FbLine(x * 3 - 2, y * 3 - 0, x * 3 + 2, y * 3 - 0);
+                FbLine(x * 3 - 2, y * 3 + 1, x * 3 + 2, y * 3 + 1);
+                FbLine(x * 3 - 2, y * 3 + 2, x * 3 + 2, y * 3 + 2);
+                FbColor(GREEN);
+                continue;
+            }
+            if (is_visited(game, mx, my)) {
+                FbHorizontalLine(x * 3 - 1, y * 3 - 1, x * 3 + 1, y * 3 - 1);
+                FbHorizontalLine(x * 3 - 1, y * 3, x * 3 + 1, y * 3);
+                FbHorizontalLine(x * 3 - 1, y * 3 + 1, x * 3 + 1, y * 3 + 1);
+            }
+       }
+    }
+    game->state = MAZE_SCREEN_RENDER;
+}
+
+/* These integer ratios approximate 0.4, 0.4 * 0.8, 0.4 * 0.8^2, 0.4 * 0.8^3, 0.4 * 0.8^4, ...
+ * which are used to approximate appropriate perspective scaling (reduction in size as viewing
+ * distance linearly increases stepwise) while avoiding floating point operations.
+ *
+ * The denominator is always 1024.
+ */
+static const int drawing_scale_numerator[] = { 410, 328, 262, 210, 168, 134, 107, 86 };
+
+static void draw_object(struct point drawing[], int npoints, int scale_index, int color, int x, int y)
+{
+    int i;
+    int xcenter = x;
+    int ycenter = y;
+    int num;
+
+    num = drawing_scale_numerator[scale_index];
+
+    FbColor(color);
+    for (i = 0; i < npoints - 1;) {
+        if (drawing[i].x == -128) {
+            i++;
+            continue;
+        }
+        if (drawing[i + 1].x == -128) {
+            i+=2;
+            continue;
+        }
+        FbLine(xcenter + ((drawing[i].x * num) >> 10), ycenter + ((drawing[i].y * num) >> 10),
+            xcenter + ((drawing[i + 1].x * num) >> 10), ycenter + ((drawing[i + 1].y * num) >> 10));
+        i++;
+    }
+}
+
+static void draw_left_passage(int start, int scale)
+{
+    FbVerticalLine(start, start, start, SCREEN_YDIM - 1 - start);
+    FbVerticalLine(start + scale, start + scale, start + scale, SCREEN_YDIM - 1 - (start + scale));
+    FbHorizontalLine(start, start + scale, start + scale, start + scale);
+    FbHorizontalLine(start, SCREEN_YDIM - 1 - (start + scale), start + scale, SCREEN_YDIM - 1 - (start + scale));
+}
+
+static void draw_right_passage(int start, int scale)
+{
+    FbVerticalLine(SCREEN_XDIM - 1 - start, start, SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start);
+    FbVerticalLine(SCREEN_XDIM - 1 - start - scale, start + scale, SCREEN_XDIM - 1 - start - scale, SCREEN_YDIM - 1 - start - scale);
+    FbHorizontalLine(SCREEN_XDIM - 1 - (start + scale), start + scale, SCREEN_XDIM - 1 - start, start + scale);
+    FbHorizontalLine(SCREEN_XDIM - 1 - (start + scale), SCREEN_YDIM - 1 - (start + scale), SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - (start + scale));
+}
+
+static void draw_left_wall(int start, int scale)
+{
+    FbLine(start, start, start + scale, start + scale);
+    FbLine(start, SCREEN_YDIM - 1 - start, start + scale, SCREEN_YDIM - 1 - (start + scale));
+}
+
+static void draw_right_wall(int start, int scale)
+{
+    FbLine(SCREEN_XDIM - 1 - start, start, SCREEN_XDIM - 1 - (start + scale), start + scale);
+    FbLine(SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start, SCREEN_XDIM - 1 - (start + scale), SCREEN_YDIM - 1 - (start + scale));
+}
+
+static void draw_forward_wall(int start, int scale)
+{
+    FbVerticalLine(start, start, start, SCREEN_YDIM - 1 - start);
+    FbVerticalLine(SCREEN_XDIM - 1 - start, start, SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start);
+    FbHorizontalLine(start, start, SCREEN_XDIM - 1 - start, start);
+    FbHorizontalLine(start, SCREEN_YDIM - 1 - start, SCREEN_XDIM - 1 - start, SCREEN_YDIM - 1 - start);
+}
+
+/* Returns 1 if traversal of ladder successful.
+ * Returns 0 if you cannot go that way.
+ */
+static int go_up_or_down(struct maze_game *game, int direction)
 {
     int i, ok, ladder_type, placement;
     unsigned char has_chalice = 0;
@@ -905,128 +1712,122 @@ static int go_up_or_down(int direction)
 
     ok = 0;
     /* Check if we are facing a down ladder */
-    for (i = 0; i < nmaze_objects; i++) {
-        if (maze_object[i].type == ladder_type &&
-            maze_object[i].x == player.x && maze_object[i].y == player.y) {
-                ok = 1;
-        }
-        if (maze_object[i].type == CHALICE &&
-            maze_object[i].x == 255)
-            has_chalice = 1;
-        if (ok && has_chalice)
-            break;
-    }
+    for (i = maze_object_first_at(game, game->player.x, game->player.y); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i))
+        if (game->object[i].type == ladder_type)
+            ok = 1;
     if (!ok)
         return 0;
+    for (i = maze_object_first_at(game, MAZE_OBJECT_IN_POCKET, 0); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i))
+        if (game->object[i].type == CHALICE)
+            has_chalice = 1;
 
-    if (direction > 0 && maze_current_level >= NLEVELS - 1)
+    if (direction > 0 && game->current_level >= NLEVELS - 1)
         return 0;
-    else if (direction < 0 && maze_current_level <= 0) {
+    else if (direction < 0 && game->current_level <= 0) {
 	if (!has_chalice) {
-            encounter_text = "YOU MUST GET";
-            encounter_adjective = "THE CHALICE";
-            encounter_name = "FIRST";
-            encounter_object = 255;
+            game->encounter_text = "YOU MUST GET";
+            game->encounter_adjective = "THE CHALICE";
+            game->encounter_name = "FIRST";
+            game->encounter_object = 255;
             return 0;
         }
     }
 
-    maze_previous_level = maze_current_level;
-    maze_current_level += direction;
-    maze_program_state = MAZE_LEVEL_INIT;
-    maze_player_initial_placement = placement;
+    maze_level_cache_store(game, game->current_level);
+    game->previous_level = game->current_level;
+    game->current_level += direction;
+    game->state = MAZE_LEVEL_INIT;
+    game->player_initial_placement = placement;
     return 1;
 }
 
-static int go_up(void)
+static int go_up(struct maze_game *game)
 {
-    return go_up_or_down(-1);
+    return go_up_or_down(game, -1);
 }
 
-static int go_down(void)
+static int go_down(struct maze_game *game)
 {
-    return go_up_or_down(1);
+    return go_up_or_down(game, 1);
 }
 
-static int check_for_encounter(unsigned char newx, unsigned char newy)
+static int check_for_encounter(struct maze_game *game, int newx, int newy)
 {
     int i, monster;
 
     monster = 0;
-    encounter_text = "x";
-    for (i = 0; i < nmaze_objects; i++) {
-        /* If we are just about to move onto a square where an object is... */
-        if (maze_object[i].x == newx && maze_object[i].y == newy) {
-            switch(maze_object_template[maze_object[i].type].category) {
-            case MAZE_OBJECT_MONSTER:
-                encounter_text = "YOU ENCOUNTER A";
-                encounter_adjective = "";
-                encounter_name = maze_object_template[maze_object[i].type].name;
-                encounter_object = i;
-                monster = 1;
-                break;
-            case MAZE_OBJECT_WEAPON:
-                encounter_text = "YOU FOUND A";
-                encounter_adjective = weapon_type[maze_object[i].tsd.weapon.type].adjective;
-                encounter_name = weapon_type[maze_object[i].tsd.weapon.type].name;
-                break;
-            case MAZE_OBJECT_KEY:
-            case MAZE_OBJECT_TREASURE:
-            case MAZE_OBJECT_SCROLL:
-            case MAZE_OBJECT_GRENADE:
-                if (!monster) {
-                    encounter_text = "YOU FOUND A";
-                    encounter_adjective = "";
-                    encounter_name = maze_object_template[maze_object[i].type].name;
-                }
-                break;
-            case MAZE_OBJECT_ARMOR:
-                if (!monster) {
-                    encounter_text = "YOU FOUND A";
-                    encounter_adjective = armor_type[maze_object[i].tsd.armor.type].adjective;
-                    encounter_name = armor_type[maze_object[i].tsd.armor.type].name;
-                }
-                break;
-            case MAZE_OBJECT_POTION:
-                if (!monster) {
-                    encounter_text = "YOU FOUND A";
-                    encounter_adjective = potion_type[maze_object[i].tsd.potion.type].adjective;
-                    encounter_name = "POTION";
-                }
-                break;
-            case MAZE_OBJECT_DOWN_LADDER:
-                if (!monster) {
-                    encounter_text = "A LADDER";
-                    encounter_adjective = "";
-                    encounter_name = "LEADS DOWN";
-                }
-                break;
-            case MAZE_OBJECT_UP_LADDER:
-                if (!monster) {
-                    encounter_text = "A LADDER";
-                    encounter_adjective = "";
-                    encounter_name = "LEADS UP";
-                }
-                break;
-            case MAZE_OBJECT_CHALICE:
-                encounter_text = "YOU FOUND THE";
-                encounter_adjective = "CHALICE OF";
-                encounter_name = "OBFUSCATION!";
-                break;
-            default:
-                if (!monster) {
-                    encounter_text = "YOU FOUND SOMETHING";
-                    encounter_adjective = "";
-                    encounter_name = maze_object_template[maze_object[i].type].name;
-                }
-                break;
+    game->encounter_text = "x";
+    /* If we are just about to move onto a square where an object is... */
+    for (i = maze_object_first_at(game, newx, newy); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i)) {
+        switch(maze_object_template[game->object[i].type].category) {
+        case MAZE_OBJECT_MONSTER:
+            game->encounter_text = "YOU ENCOUNTER A";
+            game->encounter_adjective = "";
+            game->encounter_name = maze_object_template[game->object[i].type].name;
+            game->encounter_object = i;
+            monster = 1;
+            break;
+        case MAZE_OBJECT_WEAPON:
+            game->encounter_text = "YOU FOUND A";
+            game->encounter_adjective = weapon_type[game->object[i].tsd.weapon.type].adjective;
+            game->encounter_name = weapon_type[game->object[i].tsd.weapon.type].name;
+            break;
+        case MAZE_OBJECT_KEY:
+        case MAZE_OBJECT_TREASURE:
+        case MAZE_OBJECT_SCROLL:
+        case MAZE_OBJECT_GRENADE:
+            if (!monster) {
+                game->encounter_text = "YOU FOUND A";
+                game->encounter_adjective = "";
+                game->encounter_name = maze_object_template[game->object[i].type].name;
+            }
+            break;
+        case MAZE_OBJECT_ARMOR:
+            if (!monster) {
+                game->encounter_text = "YOU FOUND A";
+                game->encounter_adjective = armor_type[game->object[i].tsd.armor.type].adjective;
+                game->encounter_name = armor_type[game->object[i].tsd.armor.type].name;
+            }
+            break;
+        case MAZE_OBJECT_POTION:
+            if (!monster) {
+                game->encounter_text = "YOU FOUND A";
+                game->encounter_adjective = potion_type[game->object[i].tsd.potion.type].adjective;
+                game->encounter_name = "POTION";
+            }
+            break;
+        case MAZE_OBJECT_DOWN_LADDER:
+            if (!monster) {
+                game->encounter_text = "A LADDER";
+                game->encounter_adjective = "";
+                game->encounter_name = "LEADS DOWN";
+            }
+            break;
+        case MAZE_OBJECT_UP_LADDER:
+            if (!monster) {
+                game->encounter_text = "A LADDER";
+                game->encounter_adjective = "";
+                game->encounter_name = "LEADS UP";
             }
+            break;
+        case MAZE_OBJECT_CHALICE:
+            game->encounter_text = "YOU FOUND THE";
+            game->encounter_adjective = "CHALICE OF";
+            game->encounter_name = "OBFUSCATION!";
+            break;
+        default:
+            if (!monster) {
+                game->encounter_text = "YOU FOUND SOMETHING";
+                game->encounter_adjective = "";
+                game->encounter_name = maze_object_template[game->object[i].type].name;
+            }
+            break;
         }
     }
     return monster;
 }
 
-static void maze_button_pressed(void)
+static void maze_button_pressed(struct maze_game *game)
 {
     int i;
 
@@ -1035,90 +1836,91 @@ static void maze_button_pressed(void)
     int takeable_object_count = 0;
     int droppable_object_count = 0;
 
-    if (game_is_won) {
-        maze_program_state = MAZE_GAME_INIT;
+    if (game->game_is_won) {
+        game->state = MAZE_GAME_INIT;
         return;
     }
-    if (player.hitpoints == 0)
+    if (game->player.hitpoints == 0)
         return;
-    if (maze_menu.menu_active) {
-        maze_program_state = maze_menu.item[maze_menu.current_item].next_state;
-        maze_menu.chosen_cookie = maze_menu.item[maze_menu.current_item].cookie;
-        maze_menu.menu_active = 0;
+    if (game->menu.menu_active) {
+        game->state = game->menu.item[game->menu.current_item].next_state;
+        game->menu.chosen_cookie = game->menu.item[game->menu.current_item].cookie;
+        game->menu.menu_active = 0;
         return;
     }
-    newx = player.x + xoff[player.direction];
-    newy = player.y + yoff[player.direction];
-    maze_menu_clear();
-    strcpy(maze_menu.title, "CHOOSE ACTION");
-    for (i = 0; i < nmaze_objects; i++) {
-        if (player.x == maze_object[i].x && player.y == maze_object[i].y) {
-            switch(maze_object_template[maze_object[i].type].category) {
-            case MAZE_OBJECT_DOWN_LADDER:
-                 maze_menu_add_item("CLIMB DOWN", MAZE_STATE_GO_DOWN, 1);
-                 break;
-            case MAZE_OBJECT_UP_LADDER:
-                 maze_menu_add_item("CLIMB UP", MAZE_STATE_GO_UP, 1);
-                 break;
-            case MAZE_OBJECT_MONSTER:
-                 monster_present = 1;
-                 break;
-            case MAZE_OBJECT_WEAPON:
-            case MAZE_OBJECT_KEY:
-            case MAZE_OBJECT_POTION:
-            case MAZE_OBJECT_TREASURE:
-            case MAZE_OBJECT_ARMOR:
-            case MAZE_OBJECT_SCROLL:
-            case MAZE_OBJECT_GRENADE:
-            case MAZE_OBJECT_CHALICE:
-                 takeable_object_count++;
-                 break;
-            default:
-                 break;
-            }
+    newx = game->player.x + xoff[game->player.direction];
+    newy = game->player.y + yoff[game->player.direction];
+    maze_menu_clear(game);
+    strcpy(game->menu.title, "CHOOSE ACTION");
+    for (i = maze_object_first_at(game, game->player.x, game->player.y); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i)) {
+        switch(maze_object_template[game->object[i].type].category) {
+        case MAZE_OBJECT_DOWN_LADDER:
+             maze_menu_add_item(game, "CLIMB DOWN", MAZE_STATE_GO_DOWN, 1);
+             break;
+        case MAZE_OBJECT_UP_LADDER:
+             maze_menu_add_item(game, "CLIMB UP", MAZE_STATE_GO_UP, 1);
+             break;
+        case MAZE_OBJECT_MONSTER:
+             monster_present = 1;
+             break;
+        case MAZE_OBJECT_WEAPON:
+        case MAZE_OBJECT_KEY:
+        case MAZE_OBJECT_POTION:
+        case MAZE_OBJECT_TREASURE:
+        case MAZE_OBJECT_ARMOR:
+        case MAZE_OBJECT_SCROLL:
+        case MAZE_OBJECT_GRENADE:
+        case MAZE_OBJECT_CHALICE:
+             takeable_object_count++;
+             break;
+        default:
+             break;
         }
-        if (maze_object[i].x == 255 && object_is_portable(i))
-           droppable_object_count++;
-        if (maze_object[i].x == newx && maze_object[i].y == newy &&
-            maze_object_template[maze_object[i].type].category == MAZE_OBJECT_MONSTER)
-            monster_present = 1;
     }
-    maze_menu_add_item("NEVER MIND", MAZE_RENDER, 1);
+    for (i = maze_object_first_at(game, MAZE_OBJECT_IN_POCKET, 0); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i))
+        if (object_is_portable(game, i))
+            droppable_object_count++;
+    for (i = maze_object_first_at(game, newx, newy); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i))
+        if (maze_object_template[game->object[i].type].category == MAZE_OBJECT_MONSTER) {
+            monster_present = 1;
+            game->encounter_object = i; /* what FIGHT MONSTER! will fight */
+        }
+    maze_menu_add_item(game, "NEVER MIND", MAZE_RENDER, 1);
     if (monster_present) {
-        maze_menu_add_item("FIGHT MONSTER!", MAZE_STATE_FIGHT, 1);
-        maze_menu_add_item("FLEE!", MAZE_STATE_FLEE, 1);
+        maze_menu_add_item(game, "FIGHT MONSTER!", MAZE_STATE_FIGHT, 1);
+        maze_menu_add_item(game, "FLEE!", MAZE_STATE_FLEE, 1);
     }
     if (takeable_object_count > 0)
-        maze_menu_add_item("TAKE ITEM", MAZE_CHOOSE_TAKE_OBJECT, takeable_object_count);
+        maze_menu_add_item(game, "TAKE ITEM", MAZE_CHOOSE_TAKE_OBJECT, takeable_object_count);
     if (droppable_object_count > 0)
-        maze_menu_add_item("DROP OBJECT",  MAZE_CHOOSE_DROP_OBJECT, 1);
-    maze_menu_add_item("VIEW MAP", MAZE_DRAW_MAP, 1);
-    maze_menu_add_item("WIELD WEAPON", MAZE_CHOOSE_WEAPON, 1);
-    maze_menu_add_item("DON ARMOR", MAZE_CHOOSE_ARMOR, 1);
-    maze_menu_add_item("READ SCROLL", MAZE_RENDER, 1);
-    maze_menu_add_item("QUAFF POTION", MAZE_CHOOSE_POTION, 1);
-    maze_menu_add_item("EXIT GAME", MAZE_EXIT, 255);
-    maze_menu.menu_active = 1;
-    maze_program_state = MAZE_DRAW_MENU;
+        maze_menu_add_item(game, "DROP OBJECT",  MAZE_CHOOSE_DROP_OBJECT, 1);
+    maze_menu_add_item(game, "VIEW MAP", MAZE_DRAW_MAP, 1);
+    maze_menu_add_item(game, "WIELD WEAPON", MAZE_CHOOSE_WEAPON, 1);
+    maze_menu_add_item(game, "DON ARMOR", MAZE_CHOOSE_ARMOR, 1);
+    maze_menu_add_item(game, "READ SCROLL", MAZE_RENDER, 1);
+    maze_menu_add_item(game, "QUAFF POTION", MAZE_CHOOSE_POTION, 1);
+    maze_menu_add_item(game, "EXIT GAME", MAZE_EXIT, 255);
+    game->menu.menu_active = 1;
+    game->state = MAZE_DRAW_MENU;
 }
 
-static void move_player_one_step(int direction)
+static void move_player_one_step(struct maze_game *game, int direction)
 {
     int newx, newy, dx, dy, dist, hp, str, damage;
 
-    if (!combat_mode) {
-       newx = player.x + xoff[direction];
-       newy = player.y + yoff[direction];
-       if (!out_of_bounds(newx, newy) && is_passage(newx, newy)) {
-           if (!check_for_encounter(newx, newy)) {
-               player.x = newx;
-               player.y = newy;
+    if (!game->combat_mode) {
+       newx = game->player.x + xoff[direction];
+       newy = game->player.y + yoff[direction];
+       if (!out_of_bounds(newx, newy) && is_passage(game, newx, newy)) {
+           if (!check_for_encounter(game, newx, newy)) {
+               game->player.x = newx;
+               game->player.y = newy;
            }
        }
    } else {
 
-       newx = player.combatx + xoff[direction] * 4;
-       newy = player.combaty + yoff[direction] * 4;
+       newx = game->player.combatx + xoff[direction] * 4;
+       newy = game->player.combaty + yoff[direction] * 4;
        if (newx < 10)
            newx = 10;
        if (newx > SCREEN_XDIM - 10)
@@ -1127,111 +1929,376 @@ static void move_player_one_step(int direction)
            newy = 10;
        if (newy > SCREEN_YDIM - 10)
            newy = SCREEN_YDIM - 10;
-       player.combatx = newx;
-       player.combaty = newy;
-       dx = player.combatx - combatant.combatx;
-       dy = player.combaty - combatant.combaty;
+       game->player.combatx = newx;
+       game->player.combaty = newy;
+       dx = game->player.combatx - game->combatant.combatx;
+       dy = game->player.combaty - game->combatant.combaty;
        dist = dx * dx + dy * dy;
        if (dist < 100) {
-           str = xorshift(&xorshift_state) % 160;
+           str = xorshift(&game->xorshift_state) % 160;
            /* damage = xorshift(&xorshift_state) % maze_object_template[maze_object[player.weapon].type].damage; */
-           if (player.weapon == 255) /* fists */
+           if (game->player.weapon == 255) /* fists */
                damage = 1;
            else
-               damage = xorshift(&xorshift_state) % weapon_type[maze_object[player.weapon].type].damage;
-           combatant.combatx -= dx * (80 + str) / 100;
-           combatant.combaty -= dy * (80 + str) / 100;
-           if (combatant.combatx < 40)
-              combatant.combatx += 40;
-           if (combatant.combatx > SCREEN_XDIM - 40)
-              combatant.combatx -= 40;
-           if (combatant.combaty < 40)
-              combatant.combaty += 40;
-           if (combatant.combaty > SCREEN_XDIM - 40)
-              combatant.combaty -= 40;
-           hp = combatant.hitpoints - damage;
+               damage = xorshift(&game->xorshift_state) % weapon_type[game->object[game->player.weapon].type].damage;
+           game->combatant.combatx -= dx * (80 + str) / 100;
+           game->combatant.combaty -= dy * (80 + str) / 100;
+           if (game->combatant.combatx < 40)
+              game->combatant.combatx += 40;
+           if (game->combatant.combatx > SCREEN_XDIM - 40)
+              game->combatant.combatx -= 40;
+           if (game->combatant.combaty < 40)
+              game->combatant.combaty += 40;
+           if (game->combatant.combaty > SCREEN_XDIM - 40)
+              game->combatant.combaty -= 40;
+           hp = game->combatant.hitpoints - damage;
            if (hp < 0)
               hp = 0;
-           combatant.hitpoints = hp;
-           if (combatant.hitpoints == 0) {
-               maze_program_state = MAZE_STATE_PLAYER_DEFEATS_MONSTER;
-               combat_mode = 0;
-               maze_object[encounter_object].x = 255; /* Move it off the board */
+           game->combatant.hitpoints = hp;
+           if (game->combatant.hitpoints == 0) {
+               game->state = MAZE_STATE_PLAYER_DEFEATS_MONSTER;
+               game->combat_mode = 0;
+               maze_object_to_pocket(game, game->encounter_object); /* Move it off the board */
            }
        }
    }
 }
 
-static void maze_menu_change_current_selection(int direction)
+static void maze_menu_change_current_selection(struct maze_game *game, int direction)
 {
-    maze_menu.current_item += direction;
-    if (maze_menu.current_item < 0)
-        maze_menu.current_item = maze_menu.nitems - 1;
-    else if (maze_menu.current_item >= maze_menu.nitems)
-        maze_menu.current_item = 0;
+    game->menu.current_item += direction;
+    if (game->menu.current_item < 0)
+        game->menu.current_item = game->menu.nitems - 1;
+    else if (game->menu.current_item >= game->menu.nitems)
+        game->menu.current_item = 0;
 }
 
-static void process_commands(void)
-{
-    int base_direction;
+#ifdef MAZE_INPUT_LOG
+/* A recorded session is the xorshift seed of each game plus every button that
+ * process_commands() consumed, which is all the input the game ever gets.  Each
+ * event is a varint of (milliseconds since the previous event << 3 | event type),
+ * and a seed is followed by its 4 bytes, least significant first.  Replay ignores
+ * the timestamps and hands each button to the next process_commands() that polls
+ * for one, so a session runs as fast as the state machine can go.
+ */
+#define MAZE_INPUT_LOG_MAGIC "MAZEINP1"
+
+enum maze_input_event {
+    MAZE_INPUT_BUTTON,
+    MAZE_INPUT_UP,
+    MAZE_INPUT_DOWN,
+    MAZE_INPUT_LEFT,
+    MAZE_INPUT_RIGHT,
+    MAZE_INPUT_SEED,
+};
 
-    base_direction = combat_mode ? 0 : player.direction;
+struct maze_input_log_header {
+    char magic[8];
+    int xdim, ydim;
+};
 
-    if (BUTTON_PRESSED_AND_CONSUME) {
-        maze_button_pressed();
-    } else if (UP_BTN_AND_CONSUME) {
-        if (maze_menu.menu_active)
-            maze_menu_change_current_selection(-1);
-        else
-            move_player_one_step(base_direction);
-    } else if (DOWN_BTN_AND_CONSUME) {
-        if (maze_menu.menu_active)
-            maze_menu_change_current_selection(1);
-        else
-            move_player_one_step(normalize_direction(base_direction + 4));
-    } else if (LEFT_BTN_AND_CONSUME) {
-        if (combat_mode)
-            move_player_one_step(6);
-        else
-            player.direction = left_dir(player.direction);
-    } else if (RIGHT_BTN_AND_CONSUME) {
-        if (combat_mode)
-            move_player_one_step(2);
-        else
-            player.direction = right_dir(player.direction);
-    } else {
-        return;
-    }
+static FILE *maze_record_file = NULL;
+static struct timeval maze_record_last_event;
+
+static unsigned char *maze_replay_data = NULL; /* the whole log */
+static size_t maze_replay_size = 0;
+static size_t maze_replay_pos = 0;
+static int maze_replay_next = -1; /* type of the next event, -1 once the log is used up */
+static unsigned int maze_replay_seed; /* valid when maze_replay_next is MAZE_INPUT_SEED */
+static unsigned long long maze_replay_msecs = 0; /* recorded time up to the next event */
+static int maze_replay_events = 0;
+static int maze_replay_diverged = 0;
 
-    if (player.hitpoints == 0) {
-        maze_program_state = MAZE_GAME_INIT;
+#ifndef MAZE_BENCHMARK
+static int maze_record_open(const char *filename)
+{
+    struct maze_input_log_header h;
+
+    maze_record_file = fopen(filename, "w");
+    if (!maze_record_file)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAZE_INPUT_LOG_MAGIC, sizeof(h.magic));
+    h.xdim = maze_xdim;
+    h.ydim = maze_ydim;
+    if (fwrite(&h, sizeof(h), 1, maze_record_file) != 1 || fflush(maze_record_file) != 0) {
+        fclose(maze_record_file);
+        maze_record_file = NULL;
+        return -1;
     }
+    gettimeofday(&maze_record_last_event, NULL);
+    return 0;
+}
+#endif
 
-    if (maze_program_state == MAZE_PROCESS_COMMANDS) {
-        if (maze_menu.menu_active)
-            maze_program_state = MAZE_DRAW_MENU;
-        else if (combat_mode)
-            maze_program_state = MAZE_COMBAT_MONSTER_MOVE;
-        else
-            maze_program_state = MAZE_RENDER;
+static void maze_record_event(int type, unsigned int seed)
+{
+    struct timeval now;
+    long long msecs;
+    unsigned long long v;
+    unsigned char buf[16];
+    int n = 0;
+
+    gettimeofday(&now, NULL);
+    msecs = ((now.tv_sec - maze_record_last_event.tv_sec) * 1000000LL +
+                (now.tv_usec - maze_record_last_event.tv_usec)) / 1000;
+    if (msecs < 0) /* the clock was set back */
+        msecs = 0;
+    maze_record_last_event = now;
+
+    v = ((unsigned long long) msecs << 3) | type;
+    do {
+        buf[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    if (type == MAZE_INPUT_SEED) {
+        buf[n++] = seed & 0xff;
+        buf[n++] = (seed >> 8) & 0xff;
+        buf[n++] = (seed >> 16) & 0xff;
+        buf[n++] = (seed >> 24) & 0xff;
+    }
+    /* Flush every event, so a crash still leaves a log that reproduces it */
+    if (fwrite(buf, n, 1, maze_record_file) != 1 || fflush(maze_record_file) != 0) {
+        fprintf(stderr, "Failed to record input, recording stopped\n");
+        fclose(maze_record_file);
+        maze_record_file = NULL;
     }
 }
 
-static void draw_objects(void)
+/* Decodes the next event of the log being replayed.  A truncated last event
+ * (from a session that crashed while recording) just ends the log.
+ */
+static void maze_replay_advance(void)
 {
-    int a, b, i, x[2], y[2], s, otype, npoints;
-    struct point *drawing;
-    int color;
+    unsigned long long v = 0;
+    unsigned char c, *p;
+    int shift = 0;
 
-    a = 0;
-    b = 1;
-    x[0] = player.x;
-    y[0] = player.y;
-    x[1] = player.x + xoff[player.direction] * 6;
-    y[1] = player.y + yoff[player.direction] * 6;
+    maze_replay_next = -1;
+    do {
+        if (maze_replay_pos >= maze_replay_size || shift > 56)
+            return;
+        c = maze_replay_data[maze_replay_pos++];
+        v |= (unsigned long long) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    if ((v & 7) > MAZE_INPUT_SEED)
+        return;
+    if ((v & 7) == MAZE_INPUT_SEED) {
+        if (maze_replay_size - maze_replay_pos < 4)
+            return;
+        p = &maze_replay_data[maze_replay_pos];
+        maze_replay_seed = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+        maze_replay_pos += 4;
+    }
+    maze_replay_msecs += v >> 3;
+    maze_replay_next = v & 7;
+}
 
-    if (x[0] == x[1]) {
-        if (y[0] > y[1]) {
+#ifdef MAZE_BENCHMARK
+/* Reads a recorded session and sets the maze dimensions it was played with */
+static int maze_replay_open(const char *filename)
+{
+    struct maze_input_log_header h;
+    FILE *f;
+    long size;
+
+    f = fopen(filename, "r");
+    if (!f)
+        return -1;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < (long) sizeof(h) ||
+        fseek(f, 0, SEEK_SET) != 0)
+        goto error;
+    maze_replay_data = malloc(size);
+    if (!maze_replay_data || fread(maze_replay_data, size, 1, f) != 1)
+        goto error;
+    fclose(f);
+    memcpy(&h, maze_replay_data, sizeof(h));
+    if (memcmp(h.magic, MAZE_INPUT_LOG_MAGIC, sizeof(h.magic)) != 0) {
+        free(maze_replay_data);
+        maze_replay_data = NULL;
+        return -1;
+    }
+    maze_set_dimensions(h.xdim, h.ydim);
+    maze_replay_size = size;
+    maze_replay_pos = sizeof(h);
+    maze_replay_advance();
+    return 0;
+
+error:
+    free(maze_replay_data);
+    maze_replay_data = NULL;
+    fclose(f);
+    return -1;
+}
+#endif
+
+#ifdef MAZE_SCHEDULER
+/* A game the scheduler is playing.  Its buttons come from maze_session_input()
+ * rather than the badge's, and while it waits for one it is parked: on no run
+ * queue, costing nothing.
+ */
+#define MAZE_SESSION_RUNNABLE 0 /* on a run queue */
+#define MAZE_SESSION_RUNNING 1
+#define MAZE_SESSION_PARKED 2
+#define MAZE_SESSION_DONE 3 /* the player chose EXIT GAME */
+
+struct maze_session {
+    struct maze_game *game;
+    void *data; /* for the scheduler's idle function */
+    unsigned int seed; /* if nonzero, maze_game_init() seeds the game with this */
+    int state; /* MAZE_SESSION_*, only changed atomically */
+    unsigned int pending[MAZE_INPUT_SEED]; /* presses of each MAZE_INPUT_* button not yet consumed */
+    struct maze_sched *sched;
+    int worker; /* whose run queue it goes back on */
+    unsigned long long steps;
+    struct maze_session *next; /* on its run queue */
+    struct maze_session *all_next;
+};
+
+static int maze_session_consume(struct maze_session *s, int button)
+{
+    unsigned int n = __atomic_load_n(&s->pending[button], __ATOMIC_SEQ_CST);
+
+    while (n && !__atomic_compare_exchange_n(&s->pending[button], &n, n - 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ;
+    return n != 0;
+}
+
+static int maze_session_has_input(struct maze_session *s)
+{
+    int i;
+
+    for (i = 0; i < MAZE_INPUT_SEED; i++)
+        if (__atomic_load_n(&s->pending[i], __ATOMIC_SEQ_CST))
+            return 1;
+    return 0;
+}
+#endif
+
+/* Stands in for one button check in process_commands(), recording the button if
+ * consume() says it was pressed, or when replaying, pressing it if it is the next
+ * one in the log.  Games the scheduler plays have buttons of their own.
+ */
+static int maze_input(struct maze_game *game, int button, int (*consume)(void))
+{
+    int pressed;
+
+#ifdef MAZE_SCHEDULER
+    if (game->session)
+        return maze_session_consume(game->session, button);
+#endif
+    pressed = consume();
+    if (maze_replay_data) {
+        if (maze_replay_next != button)
+            return 0;
+        maze_replay_events++;
+        maze_replay_advance();
+        return 1;
+    }
+    if (pressed && maze_record_file)
+        maze_record_event(button, 0);
+    return pressed;
+}
+
+/* Records the seed of a new game, or substitutes the recorded one */
+static void maze_input_seed(struct maze_game *game, unsigned int *seed)
+{
+#ifdef MAZE_SCHEDULER
+    if (game->session)
+        return;
+#endif
+    if (maze_replay_data) {
+        if (maze_replay_next == MAZE_INPUT_SEED) {
+            *seed = maze_replay_seed;
+            maze_replay_events++;
+            maze_replay_advance();
+        } else if (maze_replay_next != -1) {
+            maze_replay_diverged = 1;
+        }
+        return;
+    }
+    if (maze_record_file)
+        maze_record_event(MAZE_INPUT_SEED, *seed);
+}
+
+#undef BUTTON_PRESSED_AND_CONSUME
+#undef UP_BTN_AND_CONSUME
+#undef DOWN_BTN_AND_CONSUME
+#undef LEFT_BTN_AND_CONSUME
+#undef RIGHT_BTN_AND_CONSUME
+#define BUTTON_PRESSED_AND_CONSUME maze_input(game, MAZE_INPUT_BUTTON, button_pressed_and_consume)
+#define UP_BTN_AND_CONSUME maze_input(game, MAZE_INPUT_UP, up_btn_and_consume)
+#define DOWN_BTN_AND_CONSUME maze_input(game, MAZE_INPUT_DOWN, down_btn_and_consume)
+#define LEFT_BTN_AND_CONSUME maze_input(game, MAZE_INPUT_LEFT, left_btn_and_consume)
+#define RIGHT_BTN_AND_CONSUME maze_input(game, MAZE_INPUT_RIGHT, right_btn_and_consume)
+#endif
+
+static void process_commands(struct maze_game *game)
+{
+    int base_direction;
+
+    base_direction = game->combat_mode ? 0 : game->player.direction;
+
+    if (BUTTON_PRESSED_AND_CONSUME) {
+        maze_button_pressed(game);
+    } else if (UP_BTN_AND_CONSUME) {
+        if (game->menu.menu_active)
+            maze_menu_change_current_selection(game, -1);
+        else
+            move_player_one_step(game, base_direction);
+    } else if (DOWN_BTN_AND_CONSUME) {
+        if (game->menu.menu_active)
+            maze_menu_change_current_selection(game, 1);
+        else
+            move_player_one_step(game, normalize_direction(base_direction + 4));
+    } else if (LEFT_BTN_AND_CONSUME) {
+        if (game->combat_mode)
+            move_player_one_step(game, 6);
+        else
+            game->player.direction = left_dir(game->player.direction);
+    } else if (RIGHT_BTN_AND_CONSUME) {
+        if (game->combat_mode)
+            move_player_one_step(game, 2);
+        else
+            game->player.direction = right_dir(game->player.direction);
+    } else {
+#if defined(__linux__) && !defined(MAZE_BENCHMARK)
+        wait_for_input(); /* rather than be polled until there is some */
+#endif
+        return;
+    }
+
+    if (game->player.hitpoints == 0) {
+        game->state = MAZE_GAME_INIT;
+    }
+
+    if (game->state == MAZE_PROCESS_COMMANDS) {
+        if (game->menu.menu_active)
+            game->state = MAZE_DRAW_MENU;
+        else if (game->combat_mode)
+            game->state = MAZE_COMBAT_MONSTER_MOVE;
+        else
+            game->state = MAZE_RENDER;
+    }
+}
+
+static void draw_objects(struct maze_game *game)
+{
+    int a, b, i, x[2], y[2], s, otype, npoints;
+    struct point *drawing;
+    int color;
+
+    a = 0;
+    b = 1;
+    x[0] = game->player.x;
+    y[0] = game->player.y;
+    x[1] = game->player.x + xoff[game->player.direction] * 6;
+    y[1] = game->player.y + yoff[game->player.direction] * 6;
+
+    if (x[0] == x[1]) {
+        if (y[0] > y[1]) {
             a = 1;
             b = 0;
         }
@@ -1242,177 +2309,204 @@ static void draw_objects(void)
         }
     }
 
-    i = current_drawing_object;
-    otype = maze_object[i].type;
+    i = game->drawing_object;
+    otype = game->object[i].type;
     drawing = maze_object_template[otype].drawing;
     npoints = maze_object_template[otype].npoints;
     color = maze_object_template[otype].color;
     if (x[0] == x[1]) {
-        if (maze_object[i].x == x[0] && maze_object[i].y >= y[a] && maze_object[i].y <= y[b]) {
-            s = abs(maze_object[i].y - player.y);
-            if (s >= maze_object_distance_limit)
+        if (game->object[i].x == x[0] && game->object[i].y >= y[a] && game->object[i].y <= y[b]) {
+            s = abs(game->object[i].y - game->player.y);
+            if (s >= game->object_distance_limit)
                 goto next_object;
             draw_object(drawing, npoints, s, color, SCREEN_XDIM / 2, SCREEN_YDIM / 2);
         }
     } else if (y[0] == y[1]) {
-        if (maze_object[i].y == y[0] && maze_object[i].x >= x[a] && maze_object[i].x <= x[b]) {
-            s = abs(maze_object[i].x - player.x);
-            if (s >= maze_object_distance_limit)
+        if (game->object[i].y == y[0] && game->object[i].x >= x[a] && game->object[i].x <= x[b]) {
+            s = abs(game->object[i].x - game->player.x);
+            if (s >= game->object_distance_limit)
                 goto next_object;
             draw_object(drawing, npoints, s, color, SCREEN_XDIM / 2, SCREEN_YDIM / 2);
         }
     }
 
 next_object:
-    current_drawing_object++;
-    if (current_drawing_object >= nmaze_objects) {
-        current_drawing_object = 0;
-        maze_program_state = MAZE_RENDER_ENCOUNTER;
+    game->drawing_object++;
+    if (game->drawing_object >= game->nobjects) {
+        game->drawing_object = 0;
+        game->state = MAZE_RENDER_ENCOUNTER;
     }
 }
 
-static int maze_render_step = 0;
+static unsigned char maze_view_look(struct maze_game *game, int x, int y)
+{
+    if (out_of_bounds(x, y))
+        return MAZE_VIEW_NOTHING;
+    if (!is_passage(game, x, y))
+        return MAZE_VIEW_WALL;
+    mark_maze_square_visited(game, x, y);
+    return MAZE_VIEW_PASSAGE;
+}
 
-static void render_maze(int color)
+static void scan_maze_view(struct maze_game *game, int color)
 {
-    int x, y, ox, oy, left, right;
-    const int steps = 7;
-    int hit_back_wall = 0;
+    int step, ox, oy, left, right;
+    unsigned int key = 0;
+
+    left = left_dir(game->player.direction);
+    right = right_dir(game->player.direction);
+    game->view.back_wall = MAZE_VIEW_STEPS;
+    for (step = 0; step < MAZE_VIEW_STEPS; step++) {
+        ox = game->player.x + xoff[game->player.direction] * step;
+        oy = game->player.y + yoff[game->player.direction] * step;
+        if (!out_of_bounds(ox, oy)) {
+            if (!is_passage(game, ox, oy)) {
+                game->view.back_wall = step;
+                break;
+            }
+            mark_maze_square_visited(game, ox, oy);
+        } else {
+            key = MAZE_VIEW_UNCACHEABLE;
+        }
+        game->view.left[step] = maze_view_look(game, ox + xoff[left], oy + yoff[left]);
+        game->view.right[step] = maze_view_look(game, ox + xoff[right], oy + yoff[right]);
+        if (game->view.left[step] == MAZE_VIEW_NOTHING || game->view.right[step] == MAZE_VIEW_NOTHING)
+            key = MAZE_VIEW_UNCACHEABLE;
+        if (key != MAZE_VIEW_UNCACHEABLE)
+            key |= ((game->view.left[step] == MAZE_VIEW_PASSAGE) |
+                    ((game->view.right[step] == MAZE_VIEW_PASSAGE) << 1)) << (2 * step);
+    }
+    if (key != MAZE_VIEW_UNCACHEABLE)
+        key |= (game->view.back_wall << 14) | ((color & 0x07) << 17);
+    game->view.key = key;
+}
 
-    if (maze_render_step == 0) {
+static void render_maze(struct maze_game *game, int color)
+{
+    const int steps = MAZE_VIEW_STEPS;
+    int step = game->render_step;
+
+    if (step == 0) {
+        scan_maze_view(game, color);
+        game->object_distance_limit = game->view.back_wall;
+#ifdef MAZE_CORRIDOR_CACHE
+        if (game->view.key != MAZE_VIEW_UNCACHEABLE && FbCacheRestore(game->view.key)) {
+            game->state = MAZE_OBJECT_RENDER;
+            return;
+        }
+#endif
         FbClear();
-        maze_object_distance_limit = steps;
     }
 
     FbColor(color);
 
-    ox = player.x + xoff[player.direction] * maze_render_step;
-    oy = player.y + yoff[player.direction] * maze_render_step;
-
-    /* Draw the wall we might be facing */
-    x = ox;
-    y = oy;
-    if (!out_of_bounds(x, y)) {
-        if (!is_passage(x, y)) {
-            draw_forward_wall(maze_start, (maze_scale * 80) / 100);
-            hit_back_wall = 1;
-        } else {
-            mark_maze_square_visited(ox, oy);
-        }
-    }
-    /* Draw the wall or passage to our left */
-    left = left_dir(player.direction);
-    x = ox + xoff[left];
-    y = oy + yoff[left];
-    if (!out_of_bounds(x, y) && !hit_back_wall) {
-        if (is_passage(x, y)) {
-            draw_left_passage(maze_start, maze_scale);
-            mark_maze_square_visited(x, y);
-        } else {
-            draw_left_wall(maze_start, maze_scale);
-        }
-    }
-    /* Draw the wall or passage to our right */
-    right = right_dir(player.direction);
-    x = ox + xoff[right];
-    y = oy + yoff[right];
-    if (!out_of_bounds(x, y) && !hit_back_wall) {
-        if (is_passage(x, y)) {
-            draw_right_passage(maze_start, maze_scale);
-            mark_maze_square_visited(x, y);
-        } else {
-            draw_right_wall(maze_start, maze_scale);
-        }
+    if (step == game->view.back_wall) {
+        /* Draw the wall we are facing */
+        draw_forward_wall(game->render_start, (game->render_scale * 80) / 100);
+    } else {
+        /* Draw the wall or passage to our left */
+        if (game->view.left[step] == MAZE_VIEW_PASSAGE)
+            draw_left_passage(game->render_start, game->render_scale);
+        else if (game->view.left[step] == MAZE_VIEW_WALL)
+            draw_left_wall(game->render_start, game->render_scale);
+        /* Draw the wall or passage to our right */
+        if (game->view.right[step] == MAZE_VIEW_PASSAGE)
+            draw_right_passage(game->render_start, game->render_scale);
+        else if (game->view.right[step] == MAZE_VIEW_WALL)
+            draw_right_wall(game->render_start, game->render_scale);
     }
     /* Advance forward ahead of the player in our rendering */
-    maze_start = maze_start + maze_scale;
-    maze_scale = (maze_scale * 819) >> 10; /* Approximately multiply by 0.8 */
-    if (hit_back_wall) { /* If we are facing a wall, do not draw beyond that wall. */
-        maze_back_wall_distance = maze_render_step; /* used by draw_objects */
-        maze_object_distance_limit = maze_render_step;
-        maze_render_step = steps;
-    }
-    maze_render_step++;
-    if (maze_render_step >= steps) {
-        maze_render_step = 0;
-        maze_back_wall_distance = steps;
-        maze_program_state = MAZE_OBJECT_RENDER;
-        maze_start = 0;
-        maze_scale = 12;
+    game->render_start = game->render_start + game->render_scale;
+    game->render_scale = (game->render_scale * 819) >> 10; /* Approximately multiply by 0.8 */
+    if (step == game->view.back_wall) { /* If we are facing a wall, do not draw beyond that wall. */
+        game->back_wall_distance = game->render_step;
+        game->render_step = steps;
+    }
+    game->render_step++;
+    if (game->render_step >= steps) {
+        game->render_step = 0;
+        game->back_wall_distance = steps;
+        game->state = MAZE_OBJECT_RENDER;
+        game->render_start = 0;
+        game->render_scale = 12;
+#ifdef MAZE_CORRIDOR_CACHE
+        if (game->view.key != MAZE_VIEW_UNCACHEABLE)
+            FbCacheStore(game->view.key);
+#endif
    }
 }
 
-static void draw_encounter(void)
+static void draw_encounter(struct maze_game *game)
 {
-    maze_program_state = MAZE_DRAW_STATS;
+    game->state = MAZE_DRAW_STATS;
 
-    if (encounter_text[0] == 'x')
+    if (game->encounter_text[0] == 'x')
         return;
     FbColor(WHITE);
     FbMove(10, 90);
-    FbWriteLine(encounter_text);
+    FbWriteLine(game->encounter_text);
     FbMove(10, 100);
-    if (strcmp(encounter_adjective, "") != 0) {
-        FbWriteLine(encounter_adjective);
+    if (strcmp(game->encounter_adjective, "") != 0) {
+        FbWriteLine(game->encounter_adjective);
         FbMove(10, 110);
     }
-    FbWriteLine(encounter_name);
+    FbWriteLine(game->encounter_name);
 }
 
-static void maze_combat_monster_move(void)
+static void maze_combat_monster_move(struct maze_game *game)
 {
     int dx, dy, dist, speed, str, damage, hp, protection;
 
-    dx = player.combatx - combatant.combatx;
-    dy = player.combaty - combatant.combaty;
+    dx = game->player.combatx - game->combatant.combatx;
+    dy = game->player.combaty - game->combatant.combaty;
     dist = dx * dx + dy * dy;
-    speed = maze_object[encounter_object].tsd.monster.speed;
+    speed = game->object[game->encounter_object].tsd.monster.speed;
 
     if (dist > 100) {
         if (dx < 0)
-            combatant.combatx -= speed;
+            game->combatant.combatx -= speed;
         else if (dx > 0)
-            combatant.combatx += speed;
+            game->combatant.combatx += speed;
         if (dy < 0)
-            combatant.combaty -= speed;
+            game->combatant.combaty -= speed;
         else if (dy > 0)
-            combatant.combaty += speed;
+            game->combatant.combaty += speed;
     } else {
-        str = xorshift(&xorshift_state) % 160;
+        str = xorshift(&game->xorshift_state) % 160;
 
-        if (player.armor == 255)
+        if (game->player.armor == 255)
             protection = 0;
         else
-            protection = xorshift(&xorshift_state) % armor_type[maze_object[player.armor].tsd.armor.type].protection;
+            protection = xorshift(&game->xorshift_state) % armor_type[game->object[game->player.armor].tsd.armor.type].protection;
 
-        damage = xorshift(&xorshift_state) % maze_object_template[maze_object[encounter_object].type].damage;
+        damage = xorshift(&game->xorshift_state) % maze_object_template[game->object[game->encounter_object].type].damage;
         damage = damage - protection;
         if (damage < 0)
             damage = 0;
 
-        player.combatx += dx * (80 + str) / 100;
-        player.combaty += dy * (80 + str) / 100;
-        if (player.combatx < 40)
-           player.combatx += 40;
-        if (player.combatx > SCREEN_XDIM - 40)
-           player.combatx -= 40;
-        if (player.combaty < 40)
-           player.combaty += 40;
-        if (player.combaty > SCREEN_XDIM - 40)
-           player.combaty -= 40;
-        hp = player.hitpoints - damage;
+        game->player.combatx += dx * (80 + str) / 100;
+        game->player.combaty += dy * (80 + str) / 100;
+        if (game->player.combatx < 40)
+           game->player.combatx += 40;
+        if (game->player.combatx > SCREEN_XDIM - 40)
+           game->player.combatx -= 40;
+        if (game->player.combaty < 40)
+           game->player.combaty += 40;
+        if (game->player.combaty > SCREEN_XDIM - 40)
+           game->player.combaty -= 40;
+        hp = game->player.hitpoints - damage;
         if (hp < 0)
            hp = 0;
-        player.hitpoints = hp;
-        if (player.hitpoints == 0) {
-            maze_program_state = MAZE_STATE_PLAYER_DIED;
+        game->player.hitpoints = hp;
+        if (game->player.hitpoints == 0) {
+            game->state = MAZE_STATE_PLAYER_DIED;
             return;
         }
     }
-    maze_program_state = MAZE_RENDER_COMBAT;
+    game->state = MAZE_RENDER_COMBAT;
 }
 
-static void maze_render_combat(void)
+static void maze_render_combat(struct maze_game *game)
 {
     int color, otype, npoints;
     struct point *drawing;
@@ -1420,219 +2514,219 @@ static void maze_render_combat(void)
     FbClear();
 
     /* Draw the monster */
-    otype = maze_object[encounter_object].type;
+    otype = game->object[game->encounter_object].type;
     color = maze_object_template[otype].color;
     drawing = maze_object_template[otype].drawing;
     npoints = maze_object_template[otype].npoints;
     draw_object(drawing, npoints, ARRAYSIZE(drawing_scale_numerator) - 1,
-                color, combatant.combatx, combatant.combaty);
+                color, game->combatant.combatx, game->combatant.combaty);
 
     /* Draw the player */
     draw_object(player_points, ARRAYSIZE(player_points), ARRAYSIZE(drawing_scale_numerator) - 1,
-                WHITE, player.combatx, player.combaty);
+                WHITE, game->player.combatx, game->player.combaty);
 
-    maze_program_state = MAZE_DRAW_STATS;
+    game->state = MAZE_DRAW_STATS;
 }
 
-static void maze_player_defeats_monster(void)
+static void maze_player_defeats_monster(struct maze_game *game)
 {
     FbClear();
     FbColor(RED);
     FbMove(10, SCREEN_YDIM / 2 - 10);
     FbWriteLine("YOU KILL THE");
     FbMove(10, SCREEN_YDIM / 2);
-    FbWriteLine(encounter_name);
+    FbWriteLine(game->encounter_name);
     FbMove(10, SCREEN_YDIM / 2 + 10);
-    if (player.weapon == 255) {
+    if (game->player.weapon == 255) {
         FbWriteLine("WITH YOUR FISTS");
     } else {
         FbWriteLine("WITH THE");
         FbMove(10, SCREEN_YDIM / 2 + 20);
-        FbWriteLine(weapon_type[maze_object[player.weapon].tsd.weapon.type].adjective);
+        FbWriteLine(weapon_type[game->object[game->player.weapon].tsd.weapon.type].adjective);
         FbMove(10, SCREEN_YDIM / 2 + 30);
-        FbWriteLine(weapon_type[maze_object[player.weapon].tsd.weapon.type].name);
+        FbWriteLine(weapon_type[game->object[game->player.weapon].tsd.weapon.type].name);
     }
-    encounter_text = "x";
-    encounter_adjective = "";
-    encounter_name = "x";
-    combat_mode = 0;
-    maze_program_state = MAZE_SCREEN_RENDER;
+    game->encounter_text = "x";
+    game->encounter_adjective = "";
+    game->encounter_name = "x";
+    game->combat_mode = 0;
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_player_died(void)
+static void maze_player_died(struct maze_game *game)
 {
     FbClear();
     FbColor(RED);
     FbMove(10, SCREEN_YDIM - 20);
     FbWriteLine("YOU HAVE DIED");
     draw_object(bones_points, ARRAYSIZE(bones_points), 0, WHITE, SCREEN_XDIM / 2, SCREEN_YDIM / 2);
-    encounter_text = "x";
-    encounter_adjective = "";
-    encounter_name = "x";
-    combat_mode = 0;
-    maze_current_level = 0;
-    maze_previous_level = -1;
-    maze_player_initial_placement = MAZE_PLACE_PLAYER_BENEATH_UP_LADDER;
-    maze_program_state = MAZE_SCREEN_RENDER;
+    game->encounter_text = "x";
+    game->encounter_adjective = "";
+    game->encounter_name = "x";
+    game->combat_mode = 0;
+    game->current_level = 0;
+    game->previous_level = -1;
+    game->player_initial_placement = MAZE_PLACE_PLAYER_BENEATH_UP_LADDER;
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_choose_potion(void)
+static void maze_choose_potion(struct maze_game *game)
 {
-    int i;
+    int i, j, n;
+    unsigned char at_hand[MAX_MAZE_OBJECTS];
     char name[20];
 
-    maze_menu_clear();
-    maze_menu.menu_active = 1;
-    strcpy(maze_menu.title, "CHOOSE POTION");
+    maze_menu_clear(game);
+    game->menu.menu_active = 1;
+    strcpy(game->menu.title, "CHOOSE POTION");
 
-    for (i = 0; i < nmaze_objects; i++) {
-        if (maze_object_template[maze_object[i].type].category != MAZE_OBJECT_POTION)
+    n = maze_objects_at_hand(game, game->player.x, game->player.y, at_hand);
+    for (j = 0; j < n; j++) {
+        i = at_hand[j];
+        if (maze_object_template[game->object[i].type].category != MAZE_OBJECT_POTION)
             continue;
-        if (maze_object[i].x == 255 ||
-            (maze_object[i].x == player.x && maze_object[i].y == player.y)) {
-            strcpy(name, potion_type[maze_object[i].tsd.potion.type].adjective);
-            strcat(name, " POTION");
-            maze_menu_add_item(name, MAZE_QUAFF_POTION, i);
-        }
+        strcpy(name, potion_type[game->object[i].tsd.potion.type].adjective);
+        strcat(name, " POTION");
+        maze_menu_add_item(game, name, MAZE_QUAFF_POTION, i);
     }
-    maze_menu_add_item("NEVER MIND", MAZE_RENDER, 255);
-    maze_program_state = MAZE_DRAW_MENU;
+    maze_menu_add_item(game, "NEVER MIND", MAZE_RENDER, 255);
+    game->state = MAZE_DRAW_MENU;
 }
 
-static void maze_quaff_potion(void)
+static void maze_quaff_potion(struct maze_game *game)
 {
     short hp, delta, object, ptype;
     char *feel;
 
-    if (maze_menu.chosen_cookie == 255) { /* never mind */
-        maze_program_state = MAZE_RENDER;
+    if (game->menu.chosen_cookie == 255) { /* never mind */
+        game->state = MAZE_RENDER;
     }
-    object = maze_menu.chosen_cookie;
-    ptype = maze_object[object].tsd.potion.type;
-    delta = potion_type[ptype].health_impact;
-    maze_object[object].x = 254; /* off maze, but not in pocket, "use up" the potion */
-    hp = player.hitpoints + delta;
+    object = game->menu.chosen_cookie;
+    ptype = game->object[object].tsd.potion.type;
+    delta = game->potion_health_impact[ptype];
+    maze_object_set_location(game, object, MAZE_OBJECT_USED_UP, 0); /* off maze, but not in pocket, "use up" the potion */
+    hp = game->player.hitpoints + delta;
     if (hp > 255)
         hp = 255;
     if (hp < 0)
         hp = 0;
-    delta = hp - player.hitpoints;
+    delta = hp - game->player.hitpoints;
     if (delta < 0)
        feel = "WORSE";
     else if (delta > 0)
        feel = "BETTER";
     else
        feel = "NOTHING";
-    player.hitpoints = hp;
+    game->player.hitpoints = hp;
     FbClear();
     FbMove(10, SCREEN_YDIM / 2);
     FbWriteLine("YOU FEEL");
     FbMove(10, SCREEN_YDIM / 2 + 10);
     FbWriteLine(feel);
-    maze_program_state = MAZE_SCREEN_RENDER;
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_choose_weapon(void)
+static void maze_choose_weapon(struct maze_game *game)
 {
-    int i;
+    int i, j, n;
+    unsigned char at_hand[MAX_MAZE_OBJECTS];
     char name[20];
 
-    maze_menu_clear();
-    maze_menu.menu_active = 1;
-    strcpy(maze_menu.title, "WIELD WEAPON");
+    maze_menu_clear(game);
+    game->menu.menu_active = 1;
+    strcpy(game->menu.title, "WIELD WEAPON");
 
-    for (i = 0; i < nmaze_objects; i++) {
-        if (maze_object_template[maze_object[i].type].category != MAZE_OBJECT_WEAPON)
+    n = maze_objects_at_hand(game, game->player.x, game->player.y, at_hand);
+    for (j = 0; j < n; j++) {
+        i = at_hand[j];
+        if (maze_object_template[game->object[i].type].category != MAZE_OBJECT_WEAPON)
             continue;
-        if (maze_object[i].x == 255 ||
-            (maze_object[i].x == player.x && maze_object[i].y == player.y)) {
-            if (player.weapon == i)
-               strcpy(name, "+");
-            else
-               strcpy(name, " ");
-            strcat(name, weapon_type[maze_object[i].tsd.weapon.type].adjective);
-            strcat(name, " ");
-            strcat(name, weapon_type[maze_object[i].tsd.weapon.type].name);
-            maze_menu_add_item(name, MAZE_WIELD_WEAPON, i);
-        }
+        if (game->player.weapon == i)
+           strcpy(name, "+");
+        else
+           strcpy(name, " ");
+        strcat(name, weapon_type[game->object[i].tsd.weapon.type].adjective);
+        strcat(name, " ");
+        strcat(name, weapon_type[game->object[i].tsd.weapon.type].name);
+        maze_menu_add_item(game, name, MAZE_WIELD_WEAPON, i);
     }
-    maze_menu_add_item("NEVER MIND", MAZE_RENDER, 255);
-    maze_program_state = MAZE_DRAW_MENU;
+    maze_menu_add_item(game, "NEVER MIND", MAZE_RENDER, 255);
+    game->state = MAZE_DRAW_MENU;
 }
 
-static void maze_wield_weapon(void)
+static void maze_wield_weapon(struct maze_game *game)
 {
-    if (maze_menu.chosen_cookie == 255) { /* never mind */
-        maze_program_state = MAZE_RENDER;
+    if (game->menu.chosen_cookie == 255) { /* never mind */
+        game->state = MAZE_RENDER;
     }
-    player.weapon = maze_menu.chosen_cookie;
-    maze_object[player.weapon].x = 255; /* In case we wield directly from dungeon floor */
+    game->player.weapon = game->menu.chosen_cookie;
+    maze_object_to_pocket(game, game->player.weapon); /* In case we wield directly from dungeon floor */
     FbClear();
     FbMove(10, SCREEN_YDIM / 2);
     FbWriteLine("YOU WIELD THE");
     FbMove(10, SCREEN_YDIM / 2 + 10);
-    FbWriteLine(weapon_type[maze_object[player.weapon].tsd.weapon.type].adjective);
+    FbWriteLine(weapon_type[game->object[game->player.weapon].tsd.weapon.type].adjective);
     FbMove(10, SCREEN_YDIM / 2 + 20);
-    FbWriteLine(weapon_type[maze_object[player.weapon].tsd.weapon.type].name);
-    maze_program_state = MAZE_SCREEN_RENDER;
+    FbWriteLine(weapon_type[game->object[game->player.weapon].tsd.weapon.type].name);
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_choose_armor(void)
+static void maze_choose_armor(struct maze_game *game)
 {
-    int i;
+    int i, j, n;
+    unsigned char at_hand[MAX_MAZE_OBJECTS];
     char name[20];
 
-    maze_menu_clear();
-    maze_menu.menu_active = 1;
-    strcpy(maze_menu.title, "DON ARMOR");
+    maze_menu_clear(game);
+    game->menu.menu_active = 1;
+    strcpy(game->menu.title, "DON ARMOR");
 
-    for (i = 0; i < nmaze_objects; i++) {
-        if (maze_object_template[maze_object[i].type].category != MAZE_OBJECT_ARMOR)
+    n = maze_objects_at_hand(game, game->player.x, game->player.y, at_hand);
+    for (j = 0; j < n; j++) {
+        i = at_hand[j];
+        if (maze_object_template[game->object[i].type].category != MAZE_OBJECT_ARMOR)
             continue;
-        if (maze_object[i].x == 255 ||
-            (maze_object[i].x == player.x && maze_object[i].y == player.y)) {
-            if (player.armor == i)
-               strcpy(name, "+");
-            else
-               strcpy(name, " ");
-            strcat(name, armor_type[maze_object[i].tsd.armor.type].adjective);
-            strcat(name, " ");
-            strcat(name, armor_type[maze_object[i].tsd.armor.type].name);
-            maze_menu_add_item(name, MAZE_DON_ARMOR, i);
-        }
+        if (game->player.armor == i)
+           strcpy(name, "+");
+        else
+           strcpy(name, " ");
+        strcat(name, armor_type[game->object[i].tsd.armor.type].adjective);
+        strcat(name, " ");
+        strcat(name, armor_type[game->object[i].tsd.armor.type].name);
+        maze_menu_add_item(game, name, MAZE_DON_ARMOR, i);
     }
-    maze_menu_add_item("NEVER MIND", MAZE_RENDER, 255);
-    maze_program_state = MAZE_DRAW_MENU;
+    maze_menu_add_item(game, "NEVER MIND", MAZE_RENDER, 255);
+    game->state = MAZE_DRAW_MENU;
 }
 
-static void maze_don_armor(void)
+static void maze_don_armor(struct maze_game *game)
 {
-    if (maze_menu.chosen_cookie == 255) { /* never mind */
-        maze_program_state = MAZE_RENDER;
+    if (game->menu.chosen_cookie == 255) { /* never mind */
+        game->state = MAZE_RENDER;
     }
-    player.armor = maze_menu.chosen_cookie;
-    maze_object[player.armor].x = 255; /* In case we don directly from dungeon floor */
+    game->player.armor = game->menu.chosen_cookie;
+    maze_object_to_pocket(game, game->player.armor); /* In case we don directly from dungeon floor */
     FbClear();
     FbMove(10, SCREEN_YDIM / 2);
     FbWriteLine("YOU DON THE");
     FbMove(10, SCREEN_YDIM / 2 + 10);
-    FbWriteLine(armor_type[maze_object[player.armor].tsd.armor.type].adjective);
+    FbWriteLine(armor_type[game->object[game->player.armor].tsd.armor.type].adjective);
     FbMove(10, SCREEN_YDIM / 2 + 20);
-    FbWriteLine(armor_type[maze_object[player.armor].tsd.armor.type].name);
-    maze_program_state = MAZE_SCREEN_RENDER;
+    FbWriteLine(armor_type[game->object[game->player.armor].tsd.armor.type].name);
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_draw_stats(void)
+static void maze_draw_stats(struct maze_game *game)
 {
     char gold_pieces[10], hitpoints[10];
 
     FbColor(WHITE);
-    itoa(gold_pieces, player.gp, 10);
-    itoa(hitpoints, player.hitpoints, 10);
+    itoa(gold_pieces, game->player.gp, 10);
+    itoa(hitpoints, game->player.hitpoints, 10);
     FbMove(2, 122);
-    if (player.hitpoints < 50)
+    if (game->player.hitpoints < 50)
        FbColor(RED);
-    else if (player.hitpoints < 100)
+    else if (game->player.hitpoints < 100)
        FbColor(YELLOW);
     else
        FbColor(GREEN);
@@ -1645,77 +2739,84 @@ static void maze_draw_stats(void)
     FbMove(55 + 24, 122);
     FbWriteLine(gold_pieces);
 
-    maze_program_state = MAZE_SCREEN_RENDER;
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void init_seeds(void)
+static void init_seeds(struct maze_game *game)
 {
     int i;
 
     for (i = 0; i < NLEVELS; i++)
-        maze_random_seed[i] = xorshift(&xorshift_state);
+        game->random_seed[i] = xorshift(&game->xorshift_state);
 }
 
-static void potions_init(void)
+static void potions_init(struct maze_game *game)
 {
    int i;
 
    for (i = 0; i < ARRAYSIZE(potion_type); i++)
-       potion_type[i].health_impact = (xorshift(&xorshift_state) % 50) - 15;
+       game->potion_health_impact[i] = (xorshift(&game->xorshift_state) % 50) - 15;
 }
 
-static void maze_game_init(void)
+static void maze_game_init(struct maze_game *game)
 {
 #ifdef __linux__
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    xorshift_state = tv.tv_usec;
+    game->xorshift_state = tv.tv_usec;
 #endif
-    if (xorshift_state == 0)
-        xorshift_state = 0xa5a5a5a5;
+#ifdef MAZE_SCHEDULER
+    if (game->session && game->session->seed)
+        game->xorshift_state = game->session->seed;
+#endif
+#ifdef MAZE_INPUT_LOG
+    maze_input_seed(game, &game->xorshift_state);
+#endif
+    if (game->xorshift_state == 0)
+        game->xorshift_state = 0xa5a5a5a5;
 
-    init_seeds();
-    player_init();
-    potions_init();
+    init_seeds(game);
+    player_init(game);
+    potions_init(game);
 
-    game_is_won = 0;
+    game->game_is_won = 0;
 
-    maze_program_state = MAZE_GAME_START_MENU;
+    game->state = MAZE_GAME_START_MENU;
 }
 
-static void maze_draw_menu(void)
+static void maze_draw_menu(struct maze_game *game)
 {
     int i, y, first_item, last_item;
 
-    first_item = maze_menu.current_item - 3;
+    first_item = game->menu.current_item - 3;
     if (first_item < 0)
         first_item = 0;
-    last_item = maze_menu.current_item + 3;
-    if (last_item > maze_menu.nitems - 1)
-        last_item = maze_menu.nitems - 1;
+    last_item = game->menu.current_item + 3;
+    if (last_item > game->menu.nitems - 1)
+        last_item = game->menu.nitems - 1;
 
     FbClear();
     FbColor(WHITE);
     FbMove(8, 5);
-    FbWriteLine(maze_menu.title);
-    if (maze_menu.title2[0] != '\0') {
+    FbWriteLine(game->menu.title);
+    if (game->menu.title2[0] != '\0') {
         FbMove(8, 12);
-        FbWriteLine(maze_menu.title2);
+        FbWriteLine(game->menu.title2);
     }
-    if (maze_menu.title3[0] != '\0') {
+    if (game->menu.title3[0] != '\0') {
         FbMove(8, 19);
-        FbWriteLine(maze_menu.title3);
+        FbWriteLine(game->menu.title3);
     }
 
-    y = SCREEN_YDIM / 2 - 10 * (maze_menu.current_item - first_item);
+    y = SCREEN_YDIM / 2 - 10 * (game->menu.current_item - first_item);
     for (i = first_item; i <= last_item; i++) {
-        if (i == maze_menu.current_item)
+        if (i == game->menu.current_item)
             FbColor(GREEN);
         else
             FbColor(WHITE);
         FbMove(10, y);
-        FbWriteLine(maze_menu.item[i].text);
+        FbWriteLine(game->menu.item[i].text);
         y += 10;
     }
 
@@ -1724,138 +2825,142 @@ static void maze_draw_menu(void)
     FbHorizontalLine(5, SCREEN_YDIM / 2 + 10, SCREEN_XDIM - 5, SCREEN_YDIM / 2 + 10);
     FbVerticalLine(5, SCREEN_YDIM / 2 - 2, 5, SCREEN_YDIM / 2 + 10);
     FbVerticalLine(SCREEN_XDIM - 5, SCREEN_YDIM / 2 - 2, SCREEN_XDIM - 5, SCREEN_YDIM / 2 + 10);
-    maze_program_state = MAZE_SCREEN_RENDER;
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_game_start_menu(void)
+static void maze_game_start_menu(struct maze_game *game)
 {
 
-    maze_menu_clear();
+    maze_menu_clear(game);
 
-    maze_menu.menu_active = 1;
-    strcpy(maze_menu.title, "SEEK YE THE");
-    strcpy(maze_menu.title2, "CHALICE OF");
-    strcpy(maze_menu.title3, "OBFUSCATION!");
-    maze_menu_add_item("NEW GAME", MAZE_LEVEL_INIT, 0);
-    maze_menu_add_item("EXIT GAME", MAZE_EXIT, 0);
+    game->menu.menu_active = 1;
+    strcpy(game->menu.title, "SEEK YE THE");
+    strcpy(game->menu.title2, "CHALICE OF");
+    strcpy(game->menu.title3, "OBFUSCATION!");
+    maze_menu_add_item(game, "NEW GAME", MAZE_LEVEL_INIT, 0);
+    maze_menu_add_item(game, "EXIT GAME", MAZE_EXIT, 0);
 
-    maze_program_state = MAZE_DRAW_MENU;
+    game->state = MAZE_DRAW_MENU;
 }
 
-static void maze_begin_fight()
+static void maze_begin_fight(struct maze_game *game)
 {
-    combat_mode = 1;
-    player.combatx = SCREEN_XDIM / 2;
-    player.combaty = SCREEN_YDIM - 40;
-    combatant.combatx = SCREEN_XDIM / 2;
-    combatant.combaty = 50;
-    combatant.hitpoints = maze_object[encounter_object].tsd.monster.hitpoints;
-    maze_program_state = MAZE_RENDER_COMBAT;
+    game->combat_mode = 1;
+    game->player.combatx = SCREEN_XDIM / 2;
+    game->player.combaty = SCREEN_YDIM - 40;
+    game->combatant.combatx = SCREEN_XDIM / 2;
+    game->combatant.combaty = 50;
+    game->combatant.hitpoints = game->object[game->encounter_object].tsd.monster.hitpoints;
+    game->state = MAZE_RENDER_COMBAT;
 }
 
-static void maze_choose_take_or_drop_object(char *title, enum maze_program_state_t next_state)
+static void maze_choose_take_or_drop_object(struct maze_game *game, char *title, enum maze_program_state_t next_state)
 {
-    int i, limit;
+    int i, x, y, limit;
     char name[20];
 
-    maze_menu_clear();
-    maze_menu.menu_active = 1;
-    strcpy(maze_menu.title, title);
+    maze_menu_clear(game);
+    game->menu.menu_active = 1;
+    strcpy(game->menu.title, title);
 
-    limit = nmaze_objects;
+    limit = game->nobjects;
     if (limit > 10)
         limit = 10;
-    for (i = 0; i < nmaze_objects; i++) {
-        if ((next_state == MAZE_TAKE_OBJECT && maze_object[i].x == player.x && maze_object[i].y == player.y) ||
-            (next_state == MAZE_DROP_OBJECT && maze_object[i].x == 255)) {
-            switch(maze_object_template[maze_object[i].type].category) {
-            case MAZE_OBJECT_WEAPON:
-                if (i == player.weapon)
-                    strcpy(name, "+");
-                else
-                    strcpy(name, " ");
-                strcat(name, weapon_type[maze_object[i].tsd.weapon.type].adjective);
-                strcat(name, " ");
-                strcat(name, weapon_type[maze_object[i].tsd.weapon.type].name);
-                break;
-            case MAZE_OBJECT_KEY:
-                strcpy(name, "KEY");
-                break;
-            case MAZE_OBJECT_POTION:
-                strcpy(name, potion_type[maze_object[i].tsd.potion.type].adjective);
-                strcat(name, " POTION");
-                break;
-            case MAZE_OBJECT_TREASURE:
-                strcpy(name, "CHEST");
-                break;
-            case MAZE_OBJECT_ARMOR:
-                if (i == player.armor)
-                    strcpy(name, "+");
-                else
-                    strcpy(name, " ");
-                strcat(name, armor_type[maze_object[i].tsd.armor.type].adjective);
-                strcat(name, " ");
-                strcat(name, armor_type[maze_object[i].tsd.armor.type].name);
-                break;
-            case MAZE_OBJECT_SCROLL:
-                strcpy(name, "SCROLL");
-                break;
-            case MAZE_OBJECT_GRENADE:
-                strcpy(name, "GRENADE");
-                break;
-            case MAZE_OBJECT_CHALICE:
-                strcpy(name, "CHALICE");
-                break;
-            default:
-                continue;
-            }
-            maze_menu_add_item(name, next_state, i);
-            limit--;
-            if (limit == 0) /* Don't make the menu too big. */
-                break;
+    if (next_state == MAZE_TAKE_OBJECT) {
+        x = game->player.x;
+        y = game->player.y;
+    } else {
+        x = MAZE_OBJECT_IN_POCKET;
+        y = 0;
+    }
+    for (i = maze_object_first_at(game, x, y); i != MAZE_OBJECT_NONE; i = maze_object_next_at(game, i)) {
+        switch(maze_object_template[game->object[i].type].category) {
+        case MAZE_OBJECT_WEAPON:
+            if (i == game->player.weapon)
+                strcpy(name, "+");
+            else
+                strcpy(name, " ");
+            strcat(name, weapon_type[game->object[i].tsd.weapon.type].adjective);
+            strcat(name, " ");
+            strcat(name, weapon_type[game->object[i].tsd.weapon.type].name);
+            break;
+        case MAZE_OBJECT_KEY:
+            strcpy(name, "KEY");
+            break;
+        case MAZE_OBJECT_POTION:
+            strcpy(name, potion_type[game->object[i].tsd.potion.type].adjective);
+            strcat(name, " POTION");
+            break;
+        case MAZE_OBJECT_TREASURE:
+            strcpy(name, "CHEST");
+            break;
+        case MAZE_OBJECT_ARMOR:
+            if (i == game->player.armor)
+                strcpy(name, "+");
+            else
+                strcpy(name, " ");
+            strcat(name, armor_type[game->object[i].tsd.armor.type].adjective);
+            strcat(name, " ");
+            strcat(name, armor_type[game->object[i].tsd.armor.type].name);
+            break;
+        case MAZE_OBJECT_SCROLL:
+            strcpy(name, "SCROLL");
+            break;
+        case MAZE_OBJECT_GRENADE:
+            strcpy(name, "GRENADE");
+            break;
+        case MAZE_OBJECT_CHALICE:
+            strcpy(name, "CHALICE");
+            break;
+        default:
+            continue;
         }
+        maze_menu_add_item(game, name, next_state, i);
+        limit--;
+        if (limit == 0) /* Don't make the menu too big. */
+            break;
     }
-    maze_menu_add_item("NEVER MIND", MAZE_RENDER, 255);
-    maze_program_state = MAZE_DRAW_MENU;
+    maze_menu_add_item(game, "NEVER MIND", MAZE_RENDER, 255);
+    game->state = MAZE_DRAW_MENU;
 }
 
-static void maze_choose_take_object(void)
+static void maze_choose_take_object(struct maze_game *game)
 {
-    maze_choose_take_or_drop_object("TAKE OBJECT", MAZE_TAKE_OBJECT);
+    maze_choose_take_or_drop_object(game, "TAKE OBJECT", MAZE_TAKE_OBJECT);
 }
 
-static void maze_choose_drop_object(void)
+static void maze_choose_drop_object(struct maze_game *game)
 {
-    maze_choose_take_or_drop_object("DROP OBJECT", MAZE_DROP_OBJECT);
+    maze_choose_take_or_drop_object(game, "DROP OBJECT", MAZE_DROP_OBJECT);
 }
 
-static void maze_take_object(void)
+static void maze_take_object(struct maze_game *game)
 {
     int i;
 
-    i = maze_menu.chosen_cookie;
-    maze_object[i].x = 255; /* Take object */
-    maze_program_state = MAZE_RENDER;
+    i = game->menu.chosen_cookie;
+    maze_object_to_pocket(game, i); /* Take object */
+    game->state = MAZE_RENDER;
 
-    switch(maze_object_template[maze_object[i].type].category) {
+    switch(maze_object_template[game->object[i].type].category) {
     case MAZE_OBJECT_TREASURE:
-        player.gp += maze_object[i].tsd.treasure.gp;
-        maze_object[i].tsd.treasure.gp = 0; /* you can't get infinite gp by repeatedly dropping and taking treasure */
+        game->player.gp += game->object[i].tsd.treasure.gp;
+        game->object[i].tsd.treasure.gp = 0; /* you can't get infinite gp by repeatedly dropping and taking treasure */
         break;
     case MAZE_OBJECT_WEAPON:
-        if (player.weapon == 255) /* bare handed? Auto wield weapon. */
-            maze_program_state = MAZE_WIELD_WEAPON;
+        if (game->player.weapon == 255) /* bare handed? Auto wield weapon. */
+            game->state = MAZE_WIELD_WEAPON;
         break;
     case MAZE_OBJECT_ARMOR:
-        if (player.armor == 255) /* bare chested? Auto don armor. */
-            maze_program_state = MAZE_DON_ARMOR;
+        if (game->player.armor == 255) /* bare chested? Auto don armor. */
+            game->state = MAZE_DON_ARMOR;
         break;
     default:
         break;
     }
 }
 
-static void maze_win_condition(void)
+static void maze_win_condition(struct maze_game *game)
 {
     FbClear();
     FbColor(WHITE);
@@ -1871,148 +2976,1679 @@ static void maze_win_condition(void)
     FbWriteLine("OBFUSCATION!");
     FbMove(10, 90);
     FbWriteLine("YOU WIN!");
-    maze_menu.menu_active = 0;
-    encounter_text = "x";
-    encounter_adjective = "";
-    encounter_name = "x";
-    combat_mode = 0;
-    maze_current_level = 0;
-    maze_previous_level = -1;
-    maze_player_initial_placement = MAZE_PLACE_PLAYER_BENEATH_UP_LADDER;
-    maze_program_state = MAZE_SCREEN_RENDER;
+    game->menu.menu_active = 0;
+    game->encounter_text = "x";
+    game->encounter_adjective = "";
+    game->encounter_name = "x";
+    game->combat_mode = 0;
+    game->current_level = 0;
+    game->previous_level = -1;
+    game->player_initial_placement = MAZE_PLACE_PLAYER_BENEATH_UP_LADDER;
+    game->state = MAZE_SCREEN_RENDER;
 }
 
-static void maze_drop_object(void)
+static void maze_drop_object(struct maze_game *game)
 {
     int i;
 
-    i = maze_menu.chosen_cookie;
-    maze_object[i].x = player.x;
-    maze_object[i].y = player.y;
-    maze_program_state = MAZE_RENDER;
-    if (player.weapon == i)
-        player.weapon = 255;
-    if (player.armor == i)
-       player.armor = 255;
+    i = game->menu.chosen_cookie;
+    maze_object_set_location(game, i, game->player.x, game->player.y);
+    game->state = MAZE_RENDER;
+    if (game->player.weapon == i)
+        game->player.weapon = 255;
+    if (game->player.armor == i)
+       game->player.armor = 255;
 }
 
-int maze_cb(void)
+#ifdef __linux__
+/* Frees all of game's bitmaps.  Level installs and the level cache swap bitmaps
+ * about between the game, its generators and its cached levels, and a generator
+ * may share the game's, so they are rounded up from all those places.
+ */
+static void maze_game_free_bitmaps(struct maze_game *game)
 {
-    switch (maze_program_state) {
-    case MAZE_GAME_INIT:
-        maze_game_init();
-        break;
-    case MAZE_GAME_START_MENU:
-        maze_game_start_menu();
-        break;
-    case MAZE_LEVEL_INIT:
-        maze_init();
-        break;
-    case MAZE_BUILD:
-        generate_maze();
-        break;
-    case MAZE_PRINT:
-        print_maze();
-        break;
-    case MAZE_RENDER:
-        render_maze(level_color[maze_current_level % 3]);
-        break;
-    case MAZE_OBJECT_RENDER:
-        draw_objects();
-        break;
-    case MAZE_RENDER_ENCOUNTER:
-        draw_encounter();
-        break;
-    case MAZE_SCREEN_RENDER:
-        FbSwapBuffers();
-        maze_program_state = MAZE_PROCESS_COMMANDS;
-        break;
-    case MAZE_PROCESS_COMMANDS:
-        process_commands();
-        break;
-    case MAZE_DRAW_MAP:
-        draw_map();
-        break;
-    case MAZE_DRAW_STATS:
-        maze_draw_stats();
-        break;
-    case MAZE_DRAW_MENU:
-        maze_draw_menu();
-        break;
-    case MAZE_STATE_GO_DOWN:
-         if (!go_down())
-            maze_program_state = MAZE_RENDER;
-         break;
-    case MAZE_STATE_GO_UP:
-        if (!go_up())
-            maze_program_state = MAZE_RENDER;
-        if (maze_current_level == -1) /* They have escaped the maze with the chalice */
-            maze_program_state = MAZE_WIN_CONDITION;
-        break;
-    case MAZE_STATE_FIGHT:
-         maze_begin_fight();
-         break;
-    case MAZE_STATE_FLEE:
-         maze_program_state = MAZE_RENDER;
-         break;
-    case MAZE_COMBAT_MONSTER_MOVE:
-         maze_combat_monster_move();
-         break;
-    case MAZE_RENDER_COMBAT:
-         maze_render_combat();
-         break;
-    case MAZE_STATE_PLAYER_DEFEATS_MONSTER:
-         maze_player_defeats_monster();
-         break;
-    case MAZE_STATE_PLAYER_DIED:
-         maze_player_died();
-         break;
-    case MAZE_CHOOSE_POTION:
-         maze_choose_potion();
-         break;
-    case MAZE_QUAFF_POTION:
-         maze_quaff_potion();
-         break;
-    case MAZE_CHOOSE_WEAPON:
-         maze_choose_weapon();
-         break;
-    case MAZE_WIELD_WEAPON:
-         maze_wield_weapon();
-         break;
-    case MAZE_CHOOSE_ARMOR:
-         maze_choose_armor();
-         break;
-    case MAZE_DON_ARMOR:
-         maze_don_armor();
-         break;
-    case MAZE_CHOOSE_TAKE_OBJECT:
-         maze_choose_take_object();
-         break;
-    case MAZE_CHOOSE_DROP_OBJECT:
-         maze_choose_drop_object();
-         break;
-    case MAZE_TAKE_OBJECT:
-         maze_take_object();
-         break;
-    case MAZE_DROP_OBJECT:
-         maze_drop_object();
-         break;
-    case MAZE_EXIT:
-        maze_program_state = MAZE_GAME_INIT;
-        returnToMenus();
-        break;
-    case MAZE_WIN_CONDITION:
-        game_is_won = 1;
-        maze_win_condition();
-        break;
+    maze_word **bitmap[2 * (2 + MAZE_LEVEL_CACHE_ENTRIES + NLEVELS)];
+    int i, j, n = 0;
+
+    bitmap[n++] = &game->maze;
+    bitmap[n++] = &game->visited;
+    bitmap[n++] = &game->gen.maze;
+    bitmap[n++] = &game->gen.visited;
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++) {
+        bitmap[n++] = &game->level_cache[i].maze;
+        bitmap[n++] = &game->level_cache[i].visited;
     }
-    return 0;
+#ifdef MAZE_PREGENERATE
+    for (i = 0; i < NLEVELS; i++) {
+        bitmap[n++] = &game->pregen_slot[i].gen.maze;
+        bitmap[n++] = &game->pregen_slot[i].gen.visited;
+    }
+#endif
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < i; j++)
+            if (*bitmap[j] == *bitmap[i])
+                break;
+        if (j < i)
+            continue; /* already freed */
+#ifdef MAZE_SAVE_GAMES
+        if (game->save_mapping && (void *) *bitmap[i] >= game->save_mapping &&
+            (char *) *bitmap[i] < (char *) game->save_mapping + game->save_mapping_size)
+            continue; /* resumed from a save, see maze_load() */
+#endif
+        free(*bitmap[i]);
+    }
+    for (i = 0; i < n; i++)
+        *bitmap[i] = NULL;
+#ifdef MAZE_SAVE_GAMES
+    if (game->save_mapping)
+        munmap(game->save_mapping, game->save_mapping_size);
+    game->save_mapping = NULL;
+#endif
 }
+#endif
 
-#ifdef __linux__
-int main(int argc, char *argv[])
+#ifdef MAZE_SAVE_GAMES
+/* A save file is a header, a struct maze_save_state, and then the bitmaps of the
+ * current level followed by those of each cached level, maze then visited,
+ * MAZE_BITMAP_WORDS words each.  It is written with a single write(), and
+ * restored by mmap()ing it.  Once the header and checksum check out, the fixed
+ * part is copied into place and the bitmaps are used where they lie in the
+ * mapping, which is private so the game's changes never reach the file.
+ *
+ * The structs below are the file's layout: fixed width fields, padded by hand,
+ * so it doesn't depend on the compiler (the byte order is the machine's).  A
+ * save from a build with a different number of levels, objects or potions
+ * fails the state_size check, and one whose contents would not make sense in
+ * this game fails maze_save_state_ok(), and is not loaded.
+ */
+#define MAZE_SAVE_MAGIC "MAZESAV"
+#define MAZE_SAVE_VERSION 1
+
+struct maze_save_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t state_size; /* sizeof(struct maze_save_state) */
+    uint64_t size; /* of the whole file */
+    uint64_t checksum; /* of everything after the header */
+    int32_t xdim, ydim;
+    int32_t nbitmaps;
+    int32_t unused;
+};
+
+struct maze_save_object {
+    uint16_t x, y;
+    uint8_t type;
+    uint8_t tsd[2]; /* union maze_object_type_specific_data, all of whose members are bytes */
+    uint8_t unused;
+};
+
+struct maze_save_player {
+    uint16_t x, y;
+    uint8_t direction, combatx, combaty, hitpoints, weapon, armor;
+    uint8_t unused[2];
+    int32_t gp;
+};
+
+struct maze_save_level {
+    int32_t in_use, level;
+    uint32_t last_used;
+    int32_t nobjects;
+    uint16_t player_x, player_y;
+    struct maze_save_object object[MAX_MAZE_OBJECTS];
+};
+
+struct maze_save_state {
+    uint32_t random_seed[NLEVELS];
+    int32_t nobjects;
+    int32_t current_level, previous_level, placement;
+    uint32_t xorshift_state;
+    int32_t game_is_won;
+    int32_t encounter_object; /* the monster last met, which FIGHT MONSTER! picks up */
+    uint32_t cache_clock;
+    struct maze_save_player player;
+    struct maze_save_object object[MAX_MAZE_OBJECTS];
+    struct maze_save_level cached[MAZE_LEVEL_CACHE_ENTRIES];
+    int8_t health_impact[(ARRAYSIZE(potion_type) + 3) & ~3];
+};
+
+/* Bitmaps start at the first multiple of 8 bytes after the state */
+#define MAZE_SAVE_DATA_OFFSET ((sizeof(struct maze_save_header) + sizeof(struct maze_save_state) + 7) & ~7UL)
+
+static char *maze_save_file = NULL;
+static int maze_checkpoint_secs = 5;
+
+/* Fletcher style checksum of n 32 bit words */
+static unsigned long long maze_save_checksum(const unsigned int *p, size_t n)
+{
+    unsigned long long a = 1, b = 0;
+
+    while (n--) {
+        a = (a + *p++) % 0xffffffffULL;
+        b = (b + a) % 0xffffffffULL;
+    }
+    return (b << 32) | a;
+}
+
+static void maze_save_object_out(struct maze_save_object *d, const struct maze_object *o)
+{
+    BUILD_ASSERT(sizeof(union maze_object_type_specific_data) == sizeof(d->tsd));
+    d->x = o->x;
+    d->y = o->y;
+    d->type = o->type;
+    memcpy(d->tsd, &o->tsd, sizeof(d->tsd));
+}
+
+static void maze_save_object_in(struct maze_object *o, const struct maze_save_object *d)
+{
+    memset(o, 0, sizeof(*o));
+    o->x = d->x;
+    o->y = d->y;
+    o->type = d->type;
+    memcpy(&o->tsd, d->tsd, sizeof(d->tsd));
+}
+
+/* Whether an object from a save can be used as is: somewhere on the board or
+ * off it, and indexing only tables that are there.
+ */
+static int maze_save_object_ok(const struct maze_save_object *o, int xdim, int ydim)
 {
-        start_gtk(&argc, &argv, maze_cb, 240);
+    if (o->x == 0) /* free slot */
+        return 1;
+    if (o->x != MAZE_OBJECT_IN_POCKET && o->x != MAZE_OBJECT_USED_UP && (o->x >= xdim || o->y >= ydim))
         return 0;
+    if (o->type >= MAZE_NOBJECT_TYPES)
+        return 0;
+    /* tsd[0] is the type of a potion, armor or weapon */
+    switch (maze_object_template[o->type].category) {
+    case MAZE_OBJECT_POTION:
+        return o->tsd[0] < ARRAYSIZE(potion_type);
+    case MAZE_OBJECT_ARMOR:
+        return o->tsd[0] < ARRAYSIZE(armor_type);
+    case MAZE_OBJECT_WEAPON:
+        return o->tsd[0] < ARRAYSIZE(weapon_type);
+    default:
+        return 1;
+    }
+}
+
+/* Whether everything in st that is used as an index is in range */
+static int maze_save_state_ok(const struct maze_save_state *st, int xdim, int ydim)
+{
+    const struct maze_save_level *c;
+    int i, j;
+
+    if (st->current_level < 0 || st->current_level >= NLEVELS ||
+        st->previous_level < -1 || st->previous_level >= NLEVELS ||
+        st->placement < MAZE_PLACE_PLAYER_DO_NOT_MOVE || st->placement > MAZE_PLACE_PLAYER_ABOVE_DOWN_LADDER ||
+        st->nobjects < 0 || st->nobjects > MAX_MAZE_OBJECTS ||
+        (st->encounter_object != 255 && (st->encounter_object < 0 || st->encounter_object >= MAX_MAZE_OBJECTS)) ||
+        st->player.x >= xdim || st->player.y >= ydim ||
+        (st->player.weapon != 255 && st->player.weapon >= MAX_MAZE_OBJECTS) ||
+        (st->player.armor != 255 && st->player.armor >= MAX_MAZE_OBJECTS))
+        return 0;
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
+        if (!maze_save_object_ok(&st->object[i], xdim, ydim))
+            return 0;
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++) {
+        c = &st->cached[i];
+        if (c->in_use != 0 && c->in_use != 1)
+            return 0;
+        if (!c->in_use)
+            continue;
+        if (c->level < 0 || c->level >= NLEVELS || c->nobjects < 0 || c->nobjects > MAX_MAZE_OBJECTS ||
+            c->player_x >= xdim || c->player_y >= ydim)
+            return 0;
+        for (j = 0; j < c->nobjects; j++)
+            if (!maze_save_object_ok(&c->object[j], xdim, ydim))
+                return 0;
+    }
+    return 1;
+}
+
+static int maze_save_nbitmaps(struct maze_game *game)
+{
+    int i, nbitmaps = 2;
+
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++)
+        if (game->level_cache[i].in_use)
+            nbitmaps += 2;
+    return nbitmaps;
+}
+
+/* How big the game's save file is */
+static size_t maze_save_size(struct maze_game *game)
+{
+    return MAZE_SAVE_DATA_OFFSET + maze_save_nbitmaps(game) * sizeof(maze_word) * MAZE_BITMAP_WORDS;
+}
+
+/* Copies the game into buf, maze_save_size() bytes, laid out as a save file,
+ * all but the checksum, which maze_save_write() fills in.
+ */
+static void maze_save_fill(struct maze_game *game, unsigned char *buf)
+{
+    struct maze_save_header *h;
+    struct maze_save_state *st;
+    maze_word *bitmap;
+    size_t bitmap_bytes = sizeof(maze_word) * MAZE_BITMAP_WORDS;
+    int i, j, nbitmaps = maze_save_nbitmaps(game);
+
+    memset(buf, 0, MAZE_SAVE_DATA_OFFSET); /* the padding too */
+    h = (struct maze_save_header *) buf;
+    st = (struct maze_save_state *) (buf + sizeof(*h));
+    bitmap = (maze_word *) (buf + MAZE_SAVE_DATA_OFFSET);
+
+    BUILD_ASSERT(sizeof(struct maze_save_header) == 48);
+    BUILD_ASSERT(sizeof(struct maze_save_object) == 8);
+    BUILD_ASSERT(sizeof(struct maze_save_player) == 16);
+    for (i = 0; i < NLEVELS; i++)
+        st->random_seed[i] = game->random_seed[i];
+    for (i = 0; i < ARRAYSIZE(potion_type); i++)
+        st->health_impact[i] = game->potion_health_impact[i];
+    st->player.x = game->player.x;
+    st->player.y = game->player.y;
+    st->player.direction = game->player.direction;
+    st->player.combatx = game->player.combatx;
+    st->player.combaty = game->player.combaty;
+    st->player.hitpoints = game->player.hitpoints;
+    st->player.weapon = game->player.weapon;
+    st->player.armor = game->player.armor;
+    st->player.gp = game->player.gp;
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
+        maze_save_object_out(&st->object[i], &game->object[i]);
+    st->nobjects = game->nobjects;
+    st->current_level = game->current_level;
+    st->previous_level = game->previous_level;
+    st->placement = game->player_initial_placement;
+    st->xorshift_state = game->xorshift_state;
+    st->game_is_won = game->game_is_won;
+    st->encounter_object = game->encounter_object;
+    st->cache_clock = game->level_cache_clock;
+    memcpy(bitmap, game->maze, bitmap_bytes);
+    memcpy(bitmap + MAZE_BITMAP_WORDS, game->visited, bitmap_bytes);
+    bitmap += 2 * MAZE_BITMAP_WORDS;
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++) {
+        struct maze_level_cache_entry *e = &game->level_cache[i];
+
+        st->cached[i].in_use = e->in_use;
+        st->cached[i].level = e->level;
+        st->cached[i].last_used = e->last_used;
+        st->cached[i].nobjects = e->nobjects;
+        st->cached[i].player_x = e->player_x;
+        st->cached[i].player_y = e->player_y;
+        for (j = 0; j < MAX_MAZE_OBJECTS; j++)
+            maze_save_object_out(&st->cached[i].object[j], &e->object[j]);
+        if (!e->in_use)
+            continue;
+        memcpy(bitmap, game->level_cache[i].maze, bitmap_bytes);
+        memcpy(bitmap + MAZE_BITMAP_WORDS, game->level_cache[i].visited, bitmap_bytes);
+        bitmap += 2 * MAZE_BITMAP_WORDS;
+    }
+
+    memcpy(h->magic, MAZE_SAVE_MAGIC, sizeof(h->magic));
+    h->version = MAZE_SAVE_VERSION;
+    h->state_size = sizeof(*st);
+    h->size = MAZE_SAVE_DATA_OFFSET + nbitmaps * bitmap_bytes;
+    h->xdim = maze_xdim;
+    h->ydim = maze_ydim;
+    h->nbitmaps = nbitmaps;
+}
+
+/* Checksums a buffer filled by maze_save_fill() and writes it to filename (by
+ * way of filename.tmp, so a crash can't leave half a save behind).  Returns 0
+ * on success, -1 on failure.
+ */
+static int maze_save_write(const char *filename, unsigned char *buf)
+{
+    struct maze_save_header *h = (struct maze_save_header *) buf;
+    size_t size = h->size;
+    char tmpname[PATH_MAX];
+    int fd;
+    ssize_t rc;
+
+    h->checksum = maze_save_checksum((unsigned int *) (buf + sizeof(*h)), (size - sizeof(*h)) / 4);
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    rc = write(fd, buf, size);
+    if (close(fd) != 0 || rc != (ssize_t) size || rename(tmpname, filename) != 0) {
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/* Resumes the game saved in filename.  Returns 0 on success, or -1 if there is no
+ * valid save there, in which case nothing has been changed.  As this sets the
+ * maze dimensions, only resume a game if it is the only one.
+ */
+static int maze_load(struct maze_game *game, const char *filename)
+{
+    struct maze_save_header *h;
+    struct maze_save_state *st;
+    maze_word *bitmap;
+    size_t bitmap_words;
+    struct stat statbuf;
+    unsigned char *p;
+    int i, j, fd, nbitmaps = 2;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &statbuf) != 0 || statbuf.st_size < (off_t) MAZE_SAVE_DATA_OFFSET) {
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    h = (struct maze_save_header *) p;
+    st = (struct maze_save_state *) (p + sizeof(*h));
+    bitmap = (maze_word *) (p + MAZE_SAVE_DATA_OFFSET);
+
+    if (memcmp(h->magic, MAZE_SAVE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != MAZE_SAVE_VERSION || h->state_size != sizeof(*st) ||
+        h->size != (unsigned long long) statbuf.st_size ||
+        h->xdim < MAZE_MIN_DIM || h->xdim > MAZE_MAX_XDIM ||
+        h->ydim < MAZE_MIN_DIM || h->ydim > MAZE_MAX_YDIM)
+        goto bad_save;
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++)
+        if (st->cached[i].in_use)
+            nbitmaps += 2;
+    bitmap_words = ((h->xdim + 2 + MAZE_WORD_BITS - 1) / MAZE_WORD_BITS) * (h->ydim + 2);
+    if (h->nbitmaps != nbitmaps ||
+        h->size != MAZE_SAVE_DATA_OFFSET + nbitmaps * bitmap_words * sizeof(maze_word) ||
+        h->checksum != maze_save_checksum((unsigned int *) st, (h->size - sizeof(*h)) / 4) ||
+        !maze_save_state_ok(st, h->xdim, h->ydim))
+        goto bad_save;
+
+#ifdef MAZE_PREGENERATE
+    maze_pregen_cancel(game);
+#endif
+    maze_game_free_bitmaps(game); /* they may be the wrong size now */
+    maze_set_dimensions(h->xdim, h->ydim);
+    for (i = 0; i < NLEVELS; i++)
+        game->random_seed[i] = st->random_seed[i];
+    for (i = 0; i < ARRAYSIZE(potion_type); i++)
+        game->potion_health_impact[i] = st->health_impact[i];
+    game->player.x = st->player.x;
+    game->player.y = st->player.y;
+    game->player.direction = st->player.direction;
+    game->player.combatx = st->player.combatx;
+    game->player.combaty = st->player.combaty;
+    game->player.hitpoints = st->player.hitpoints;
+    game->player.weapon = st->player.weapon;
+    game->player.armor = st->player.armor;
+    game->player.gp = st->player.gp;
+    for (i = 0; i < MAX_MAZE_OBJECTS; i++)
+        maze_save_object_in(&game->object[i], &st->object[i]);
+    game->nobjects = st->nobjects;
+    maze_object_index_rebuild(game);
+    game->current_level = st->current_level;
+    game->previous_level = st->previous_level;
+    game->player_initial_placement = st->placement;
+    game->xorshift_state = st->xorshift_state;
+    game->game_is_won = st->game_is_won;
+    game->encounter_object = st->encounter_object;
+    game->level_cache_clock = st->cache_clock;
+    game->maze = bitmap;
+    game->visited = bitmap + bitmap_words;
+    bitmap += 2 * bitmap_words;
+    for (i = 0; i < MAZE_LEVEL_CACHE_ENTRIES; i++) {
+        struct maze_level_cache_entry *e = &game->level_cache[i];
+
+        e->in_use = st->cached[i].in_use;
+        e->level = st->cached[i].level;
+        e->last_used = st->cached[i].last_used;
+        e->nobjects = st->cached[i].nobjects;
+        e->player_x = st->cached[i].player_x;
+        e->player_y = st->cached[i].player_y;
+        for (j = 0; j < MAX_MAZE_OBJECTS; j++)
+            maze_save_object_in(&e->object[j], &st->cached[i].object[j]);
+        e->maze = e->visited = NULL;
+        if (!e->in_use)
+            continue;
+        game->level_cache[i].maze = bitmap;
+        game->level_cache[i].visited = bitmap + bitmap_words;
+        bitmap += 2 * bitmap_words;
+    }
+    /* The bitmaps live in the mapping from now on, until maze_game_free() */
+    game->save_mapping = p;
+    game->save_mapping_size = statbuf.st_size;
+    game->combat_mode = 0;
+    FbInit();
+    game->state = MAZE_RENDER;
+    return 0;
+
+bad_save:
+    fprintf(stderr, "%s is not a usable saved game\n", filename);
+    munmap(p, statbuf.st_size);
+    return -1;
+}
+
+/* The checkpoint being written.  The buffer is kept for the next one, so that
+ * copying into it doesn't fault in fresh pages every time.
+ */
+static unsigned char *maze_checkpoint_buf;
+static size_t maze_checkpoint_buf_size;
+static int maze_checkpoint_busy; /* while maze_checkpoint_buf is being written, only changed atomically */
+
+static void *maze_checkpoint_writer(__attribute__((unused)) void *arg)
+{
+    if (maze_save_write(maze_save_file, maze_checkpoint_buf) != 0)
+        fprintf(stderr, "Failed to save game to %s\n", maze_save_file);
+    __atomic_store_n(&maze_checkpoint_busy, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Saves the game every maze_checkpoint_secs, if there is a save file.  Only the
+ * copy is made here, on the game's thread.  The checksum and the write, which
+ * for a big maze take long enough to stall a frame, are left to a thread of
+ * their own, and a checkpoint that comes due while the last is still being
+ * written is put off until the next MAZE_RENDER.
+ */
+static void maze_checkpoint(struct maze_game *game)
+{
+    struct timeval tv;
+    size_t size;
+    unsigned char *buf;
+    pthread_t thr;
+
+    if (!maze_save_file || game->combat_mode)
+        return;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec - game->last_checkpoint < maze_checkpoint_secs)
+        return;
+    if (__atomic_exchange_n(&maze_checkpoint_busy, 1, __ATOMIC_ACQUIRE))
+        return;
+    game->last_checkpoint = tv.tv_sec;
+    size = maze_save_size(game);
+    if (size > maze_checkpoint_buf_size) {
+        buf = realloc(maze_checkpoint_buf, size);
+        if (!buf)
+            goto failed;
+        maze_checkpoint_buf = buf;
+        maze_checkpoint_buf_size = size;
+    }
+    maze_save_fill(game, maze_checkpoint_buf);
+    if (pthread_create(&thr, NULL, maze_checkpoint_writer, NULL) != 0)
+        goto failed;
+    pthread_detach(thr);
+    return;
+
+failed:
+    fprintf(stderr, "Failed to save game to %s\n", maze_save_file);
+    __atomic_store_n(&maze_checkpoint_busy, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Gets a game ready for its first maze_game_cb().  Returns 0, or -1 if there is
+ * no memory for the bitmaps.
+ */
+static int maze_game_setup(struct maze_game *game)
+{
+    memset(game, 0, sizeof(*game));
+    game->state = MAZE_GAME_INIT;
+    game->xorshift_state = 0xa5a5a5a5;
+    game->previous_level = -1;
+    game->player_initial_placement = MAZE_PLACE_PLAYER_BENEATH_UP_LADDER;
+    game->encounter_text = "x";
+    game->encounter_adjective = "";
+    game->encounter_name = "";
+    game->encounter_object = 255;
+    game->render_scale = 12;
+    game->back_wall_distance = 7;
+#ifdef __linux__
+    game->maze = calloc(MAZE_BITMAP_WORDS, sizeof(*game->maze));
+    game->visited = calloc(MAZE_BITMAP_WORDS, sizeof(*game->visited));
+    if (!game->maze || !game->visited) {
+        free(game->maze);
+        free(game->visited);
+        return -1;
+    }
+#else
+    game->maze = maze_storage;
+    game->visited = maze_visited_storage;
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+/* Returns a new game, or NULL if out of memory */
+static struct maze_game *maze_game_new(void)
+{
+    struct maze_game *game = malloc(sizeof(*game));
+
+    if (game && maze_game_setup(game) != 0) {
+        free(game);
+        return NULL;
+    }
+    return game;
+}
+
+static void maze_game_free(struct maze_game *game)
+{
+#ifdef MAZE_PREGENERATE
+    int i;
+
+    maze_pregen_cancel(game);
+    for (i = 0; i < NLEVELS; i++)
+        free(game->pregen_slot[i].gen.stack);
+#endif
+    maze_game_free_bitmaps(game);
+    free(game->gen.stack);
+    free(game);
+}
+#endif
+
+/* Advances game by one state */
+static void maze_game_step(struct maze_game *game)
+{
+    switch (game->state) {
+    case MAZE_GAME_INIT:
+        maze_game_init(game);
+        break;
+    case MAZE_GAME_START_MENU:
+        maze_game_start_menu(game);
+        break;
+    case MAZE_LEVEL_INIT:
+        maze_init(game);
+        break;
+    case MAZE_BUILD:
+        maze_build(game);
+        break;
+    case MAZE_PRINT:
+        print_maze(game);
+        break;
+    case MAZE_RENDER:
+#ifdef MAZE_PREGENERATE
+        maze_pregen_neighbours(game);
+#endif
+#ifdef MAZE_SAVE_GAMES
+        maze_checkpoint(game);
+#endif
+        render_maze(game, level_color[game->current_level % 3]);
+        break;
+    case MAZE_OBJECT_RENDER:
+        draw_objects(game);
+        break;
+    case MAZE_RENDER_ENCOUNTER:
+        draw_encounter(game);
+        break;
+    case MAZE_SCREEN_RENDER:
+        FbSwapBuffers();
+        game->state = MAZE_PROCESS_COMMANDS;
+        break;
+    case MAZE_PROCESS_COMMANDS:
+        process_commands(game);
+        break;
+    case MAZE_DRAW_MAP:
+        draw_map(game);
+        break;
+    case MAZE_DRAW_STATS:
+        maze_draw_stats(game);
+        break;
+    case MAZE_DRAW_MENU:
+        maze_draw_menu(game);
+        break;
+    case MAZE_STATE_GO_DOWN:
+         if (!go_down(game))
+            game->state = MAZE_RENDER;
+         break;
+    case MAZE_STATE_GO_UP:
+        if (!go_up(game))
+            game->state = MAZE_RENDER;
+        if (game->current_level == -1) /* They have escaped the maze with the chalice */
+            game->state = MAZE_WIN_CONDITION;
+        break;
+    case MAZE_STATE_FIGHT:
+         maze_begin_fight(game);
+         break;
+    case MAZE_STATE_FLEE:
+         game->state = MAZE_RENDER;
+         break;
+    case MAZE_COMBAT_MONSTER_MOVE:
+         maze_combat_monster_move(game);
+         break;
+    case MAZE_RENDER_COMBAT:
+         maze_render_combat(game);
+         break;
+    case MAZE_STATE_PLAYER_DEFEATS_MONSTER:
+         maze_player_defeats_monster(game);
+         break;
+    case MAZE_STATE_PLAYER_DIED:
+         maze_player_died(game);
+         break;
+    case MAZE_CHOOSE_POTION:
+         maze_choose_potion(game);
+         break;
+    case MAZE_QUAFF_POTION:
+         maze_quaff_potion(game);
+         break;
+    case MAZE_CHOOSE_WEAPON:
+         maze_choose_weapon(game);
+         break;
+    case MAZE_WIELD_WEAPON:
+         maze_wield_weapon(game);
+         break;
+    case MAZE_CHOOSE_ARMOR:
+         maze_choose_armor(game);
+         break;
+    case MAZE_DON_ARMOR:
+         maze_don_armor(game);
+         break;
+    case MAZE_CHOOSE_TAKE_OBJECT:
+         maze_choose_take_object(game);
+         break;
+    case MAZE_CHOOSE_DROP_OBJECT:
+         maze_choose_drop_object(game);
+         break;
+    case MAZE_TAKE_OBJECT:
+         maze_take_object(game);
+         break;
+    case MAZE_DROP_OBJECT:
+         maze_drop_object(game);
+         break;
+    case MAZE_EXIT:
+        game->state = MAZE_GAME_INIT;
+#ifdef MAZE_SCHEDULER
+        if (game->session) {
+            /* Only this game is over, not the whole process */
+            __atomic_store_n(&game->session->state, MAZE_SESSION_DONE, __ATOMIC_SEQ_CST);
+            break;
+        }
+#endif
+        returnToMenus();
+        break;
+    case MAZE_WIN_CONDITION:
+        game->game_is_won = 1;
+        maze_win_condition(game);
+        break;
+    }
+}
+
+#ifdef MAZE_PROFILE
+/* How long each state's step takes, for all games together */
+static int maze_profiling;
+#ifdef MAZE_BENCHMARK
+static volatile sig_atomic_t maze_profile_requested; /* by SIGUSR1 */
+#endif
+static struct profile_counter maze_state_profile[MAZE_EXIT + 1];
+static const char *maze_state_name[] = {
+    "MAZE_GAME_INIT",
+    "MAZE_GAME_START_MENU",
+    "MAZE_LEVEL_INIT",
+    "MAZE_BUILD",
+    "MAZE_PRINT",
+    "MAZE_RENDER",
+    "MAZE_OBJECT_RENDER",
+    "MAZE_RENDER_ENCOUNTER",
+    "MAZE_DRAW_STATS",
+    "MAZE_SCREEN_RENDER",
+    "MAZE_PROCESS_COMMANDS",
+    "MAZE_DRAW_MAP",
+    "MAZE_DRAW_MENU",
+    "MAZE_STATE_GO_DOWN",
+    "MAZE_STATE_GO_UP",
+    "MAZE_STATE_FIGHT",
+    "MAZE_STATE_FLEE",
+    "MAZE_RENDER_COMBAT",
+    "MAZE_COMBAT_MONSTER_MOVE",
+    "MAZE_STATE_PLAYER_DEFEATS_MONSTER",
+    "MAZE_STATE_PLAYER_DIED",
+    "MAZE_CHOOSE_POTION",
+    "MAZE_QUAFF_POTION",
+    "MAZE_CHOOSE_WEAPON",
+    "MAZE_WIELD_WEAPON",
+    "MAZE_CHOOSE_ARMOR",
+    "MAZE_DON_ARMOR",
+    "MAZE_CHOOSE_TAKE_OBJECT",
+    "MAZE_CHOOSE_DROP_OBJECT",
+    "MAZE_TAKE_OBJECT",
+    "MAZE_DROP_OBJECT",
+    "MAZE_WIN_CONDITION",
+    "MAZE_EXIT",
+};
+
+static void maze_profile_print(void)
+{
+    int i;
+
+    for (i = 0; i <= MAZE_EXIT; i++)
+        if (__atomic_load_n(&maze_state_profile[i].count, __ATOMIC_RELAXED))
+            break;
+    if (i > MAZE_EXIT)
+        return; /* e.g. --replay, where each session's process prints its own */
+    profile_print(NULL, NULL);
+    for (i = 0; i <= MAZE_EXIT; i++)
+        profile_print(maze_state_name[i], &maze_state_profile[i]);
+    profile_print_linuxcompat();
+}
+
+#ifdef MAZE_BENCHMARK
+/* Printing isn't safe in a signal handler, so the next step does it */
+static void maze_profile_signal(__attribute__((unused)) int sig)
+{
+    maze_profile_requested = 1;
+}
+#endif
+
+/* Count, total and longest time of each state from now on.  The table goes to
+ * stderr at exit, and whenever the process gets SIGUSR1: from the GTK main
+ * loop, as the game may be parked waiting for a key, or in maze-bench, whose
+ * games never wait for anyone, at the next step of any game.
+ */
+static void maze_profile_start(void)
+{
+    BUILD_ASSERT(sizeof(maze_state_name) / sizeof(maze_state_name[0]) == MAZE_EXIT + 1);
+    maze_profiling = 1;
+    profile_enable();
+    atexit(maze_profile_print);
+#ifdef MAZE_BENCHMARK
+    signal(SIGUSR1, maze_profile_signal);
+#else
+    profile_print_on_signal(SIGUSR1, maze_profile_print);
+#endif
+}
+#endif
+
+static int maze_game_cb(struct maze_game *game)
+{
+#ifdef MAZE_PROFILE
+    if (maze_profiling) {
+        enum maze_program_state_t state = game->state;
+        unsigned long long start = profile_now_ns();
+
+        maze_game_step(game);
+        profile_add(&maze_state_profile[state], start);
+#ifdef MAZE_BENCHMARK
+        /* Games on other threads may be here too, only one prints */
+        if (maze_profile_requested && __atomic_exchange_n(&maze_profile_requested, 0, __ATOMIC_SEQ_CST))
+            maze_profile_print();
+#endif
+        return 0;
+    }
+#endif
+    maze_game_step(game);
+    return 0;
+}
+
+/* The game maze_cb() plays */
+static struct maze_game maze_cb_game;
+
+int maze_cb(void)
+{
+    if (!maze_cb_game.maze && maze_game_setup(&maze_cb_game) != 0)
+        return 0;
+    return maze_game_cb(&maze_cb_game);
+}
+
+#ifdef MAZE_SCHEDULER
+/* Plays many games on a pool of worker threads.  Each worker has a run queue
+ * of its own, and a worker whose queue is empty steals from the others.  A
+ * session runs until it is waiting for a button nobody has pressed, then it is
+ * parked, on no queue at all, until maze_session_input() presses one.
+ *
+ * Generating a level can take a while, so a session in MAZE_LEVEL_INIT or
+ * MAZE_BUILD goes to the back of the queue after a quantum of states.  Once it
+ * starts drawing a frame it finishes it, since the screen it draws on belongs
+ * to the worker's thread.
+ */
+#define MAZE_SCHED_MAX_WORKERS 64
+#define MAZE_SCHED_QUANTUM 256 /* states */
+
+struct maze_sched;
+
+struct maze_sched_worker {
+    struct maze_sched *sched;
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock; /* protects head and tail */
+    struct maze_session *head, *tail;
+    unsigned long long steps, steals;
+};
+
+struct maze_sched {
+    int nworkers;
+    struct maze_sched_worker worker[MAZE_SCHED_MAX_WORKERS];
+    int (*idle)(void *data); /* see maze_sched_new() */
+    int queued; /* sessions on run queues, only changed atomically */
+    int active; /* sessions neither parked nor done, only changed atomically */
+    int sleepers; /* workers waiting for something to be queued, only changed atomically */
+    int stop; /* only changed atomically */
+    pthread_mutex_t lock; /* protects sessions and next_worker */
+    pthread_cond_t work_cond, idle_cond;
+    struct maze_session *sessions;
+    int next_worker; /* whose queue maze_sched_add() uses next */
+};
+
+static void maze_sched_push(struct maze_sched_worker *w, struct maze_session *s)
+{
+    struct maze_sched *sched = w->sched;
+
+    s->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+        w->tail->next = s;
+    else
+        w->head = s;
+    w->tail = s;
+    pthread_mutex_unlock(&w->lock);
+    __atomic_add_fetch(&sched->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->work_cond);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+static struct maze_session *maze_sched_pop(struct maze_sched_worker *w)
+{
+    struct maze_session *s;
+
+    pthread_mutex_lock(&w->lock);
+    s = w->head;
+    if (s) {
+        w->head = s->next;
+        if (!w->head)
+            w->tail = NULL;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (s)
+        __atomic_sub_fetch(&w->sched->queued, 1, __ATOMIC_SEQ_CST);
+    return s;
+}
+
+static struct maze_session *maze_sched_steal(struct maze_sched_worker *w)
+{
+    struct maze_sched *sched = w->sched;
+    struct maze_session *s;
+    int i;
+
+    for (i = 1; i < sched->nworkers; i++) {
+        s = maze_sched_pop(&sched->worker[(w->id + i) % sched->nworkers]);
+        if (s) {
+            w->steals++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* One fewer session is running, wake maze_sched_wait_idle() if that was the last */
+static void maze_sched_deactivate(struct maze_sched *sched)
+{
+    if (__atomic_sub_fetch(&sched->active, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_broadcast(&sched->idle_cond);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+/* Presses a button in a session's game, and wakes the session if it is parked.
+ * May be called from any thread.
+ */
+static void maze_session_input(struct maze_session *s, int button)
+{
+    struct maze_sched *sched = s->sched;
+    int parked = MAZE_SESSION_PARKED;
+
+    __atomic_add_fetch(&s->pending[button], 1, __ATOMIC_SEQ_CST);
+    /* Count it as active before it can run, so it can't be seen as idle in between */
+    __atomic_add_fetch(&sched->active, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_compare_exchange_n(&s->state, &parked, MAZE_SESSION_RUNNABLE, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        maze_sched_push(&sched->worker[s->worker], s);
+    else
+        maze_sched_deactivate(sched); /* it is running and will see the button */
+}
+
+/* Parks a session that is waiting for input.  Returns 0 if input came in the
+ * meantime and the caller should carry on running it.
+ */
+static int maze_session_park(struct maze_session *s)
+{
+    int parked = MAZE_SESSION_PARKED;
+
+    __atomic_store_n(&s->state, MAZE_SESSION_PARKED, __ATOMIC_SEQ_CST);
+    if (maze_session_has_input(s) &&
+        __atomic_compare_exchange_n(&s->state, &parked, MAZE_SESSION_RUNNING, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return 0;
+    /* Parked, or maze_session_input() got there first and requeued it */
+    maze_sched_deactivate(s->sched);
+    return 1;
+}
+
+static void maze_sched_run(struct maze_sched_worker *w, struct maze_session *s)
+{
+    struct maze_sched *sched = w->sched;
+    struct maze_game *game = s->game;
+    int steps = 0, button;
+
+    s->worker = w->id;
+    __atomic_store_n(&s->state, MAZE_SESSION_RUNNING, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (game->state == MAZE_PROCESS_COMMANDS && __atomic_load_n(&sched->stop, __ATOMIC_SEQ_CST))
+            return;
+        if (game->state == MAZE_PROCESS_COMMANDS && !maze_session_has_input(s)) {
+            button = sched->idle ? sched->idle(s->data) : -1;
+            if (button >= 0)
+                maze_session_input(s, button);
+            else if (maze_session_park(s))
+                return;
+        }
+        maze_game_cb(game);
+        s->steps++;
+        w->steps++;
+        if (__atomic_load_n(&s->state, __ATOMIC_SEQ_CST) == MAZE_SESSION_DONE) {
+            maze_sched_deactivate(sched);
+            return;
+        }
+        if (++steps >= MAZE_SCHED_QUANTUM &&
+            (game->state == MAZE_LEVEL_INIT || game->state == MAZE_BUILD)) {
+            __atomic_store_n(&s->state, MAZE_SESSION_RUNNABLE, __ATOMIC_SEQ_CST);
+            maze_sched_push(w, s);
+            return;
+        }
+    }
+}
+
+static void *maze_sched_worker_main(void *arg)
+{
+    struct maze_sched_worker *w = arg;
+    struct maze_sched *sched = w->sched;
+    struct maze_session *s;
+
+    while (!__atomic_load_n(&sched->stop, __ATOMIC_SEQ_CST)) {
+        s = maze_sched_pop(w);
+        if (!s)
+            s = maze_sched_steal(w);
+        if (s) {
+            maze_sched_run(w, s);
+            continue;
+        }
+        pthread_mutex_lock(&sched->lock);
+        __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&sched->stop, __ATOMIC_SEQ_CST) &&
+                __atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&sched->work_cond, &sched->lock);
+        __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return NULL;
+}
+
+/* Stops the first nthreads workers, once the sessions they are running are at the end of a frame */
+static void maze_sched_stop(struct maze_sched *sched, int nthreads)
+{
+    int i;
+
+    pthread_mutex_lock(&sched->lock);
+    __atomic_store_n(&sched->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&sched->work_cond);
+    pthread_mutex_unlock(&sched->lock);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(sched->worker[i].thread, NULL);
+}
+
+/* Starts nworkers threads to play games on.  When a session has used up its
+ * input, idle (if not NULL) is called on the worker with the session's data,
+ * and returns the MAZE_INPUT_* button to press next, or -1 to park the session.
+ * Returns NULL if the threads can't be made.
+ */
+static struct maze_sched *maze_sched_new(int nworkers, int (*idle)(void *data))
+{
+    struct maze_sched *sched;
+    int i;
+
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > MAZE_SCHED_MAX_WORKERS)
+        nworkers = MAZE_SCHED_MAX_WORKERS;
+    sched = calloc(1, sizeof(*sched));
+    if (!sched)
+        return NULL;
+    sched->idle = idle;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_cond, NULL);
+    pthread_cond_init(&sched->idle_cond, NULL);
+    sched->nworkers = nworkers;
+    for (i = 0; i < nworkers; i++) {
+        sched->worker[i].sched = sched;
+        sched->worker[i].id = i;
+        pthread_mutex_init(&sched->worker[i].lock, NULL);
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&sched->worker[i].thread, NULL, maze_sched_worker_main, &sched->worker[i]) != 0) {
+            maze_sched_stop(sched, i);
+            free(sched);
+            return NULL;
+        }
+    }
+    return sched;
+}
+
+/* Has the scheduler play game, starting from whatever state it is in.  If seed
+ * is nonzero the game uses it rather than the time when it (re)starts.  Returns
+ * NULL if out of memory.
+ */
+static struct maze_session *maze_sched_add(struct maze_sched *sched, struct maze_game *game,
+                unsigned int seed, void *data)
+{
+    struct maze_session *s = calloc(1, sizeof(*s));
+
+    if (!s)
+        return NULL;
+    s->sched = sched;
+    s->game = game;
+    s->data = data;
+    s->seed = seed;
+    s->state = MAZE_SESSION_RUNNABLE;
+    game->session = s;
+    pthread_mutex_lock(&sched->lock);
+    s->all_next = sched->sessions;
+    sched->sessions = s;
+    s->worker = sched->next_worker;
+    sched->next_worker = (sched->next_worker + 1) % sched->nworkers;
+    pthread_mutex_unlock(&sched->lock);
+    __atomic_add_fetch(&sched->active, 1, __ATOMIC_SEQ_CST);
+    maze_sched_push(&sched->worker[s->worker], s);
+    return s;
+}
+
+/* Waits until every session is parked or done */
+static void maze_sched_wait_idle(struct maze_sched *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    while (__atomic_load_n(&sched->active, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&sched->idle_cond, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Stops the workers and frees the sessions.  The games are the caller's to free. */
+static void maze_sched_free(struct maze_sched *sched)
+{
+    struct maze_session *s, *next;
+
+    maze_sched_stop(sched, sched->nworkers);
+    for (s = sched->sessions; s; s = next) {
+        next = s->all_next;
+        s->game->session = NULL;
+        free(s);
+    }
+    free(sched);
+}
+#endif
+
+#if defined(__linux__) && !defined(MAZE_BENCHMARK)
+/* On linux there is no badge watchdog to yield to, so rather than advancing the
+ * state machine by a single state per timer tick (which spreads one redraw over
+ * dozens of ticks), keep stepping it until it is waiting for input again or the
+ * time budget for this tick runs out.  A budget of 0 gives the badge behavior.
+ */
+static int maze_tick_budget_usec = 3000;
+static struct maze_game *maze_gtk_game; /* the game in the window */
+
+static int maze_run_to_completion_cb(void)
+{
+    struct maze_game *game = maze_gtk_game;
+    struct timeval start, now;
+    long elapsed;
+
+    if (maze_tick_budget_usec <= 0)
+        return maze_game_cb(game);
+
+    gettimeofday(&start, NULL);
+    do {
+        maze_game_cb(game);
+        if (game->state == MAZE_PROCESS_COMMANDS)
+            break;
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+    } while (elapsed < maze_tick_budget_usec);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        int i, xdim = maze_xdim, ydim = maze_ydim;
+        char *record_file = NULL;
+
+        for (i = 1; i < argc - 1; i++) {
+                if (strcmp(argv[i], "--tick-budget-usec") == 0)
+                        maze_tick_budget_usec = atoi(argv[i + 1]);
+                if (strcmp(argv[i], "--maze-xdim") == 0)
+                        xdim = atoi(argv[i + 1]);
+                if (strcmp(argv[i], "--maze-ydim") == 0)
+                        ydim = atoi(argv[i + 1]);
+                if (strcmp(argv[i], "--save-file") == 0)
+                        maze_save_file = argv[i + 1];
+                if (strcmp(argv[i], "--checkpoint-secs") == 0)
+                        maze_checkpoint_secs = atoi(argv[i + 1]);
+                if (strcmp(argv[i], "--record") == 0)
+                        record_file = argv[i + 1];
+        }
+        for (i = 1; i < argc; i++)
+                if (strcmp(argv[i], "--profile") == 0)
+                        maze_profile_start();
+        maze_set_dimensions(xdim, ydim);
+        maze_gtk_game = maze_game_new();
+        if (!maze_gtk_game) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+        }
+        if (record_file) {
+                /* A replay starts from a new game, so don't resume a saved one */
+                if (maze_record_open(record_file) != 0) {
+                        fprintf(stderr, "Cannot record to %s\n", record_file);
+                        return 1;
+                }
+        } else if (maze_save_file && maze_load(maze_gtk_game, maze_save_file) == 0) {
+                /* Pick up where the last session left off, if it saved a game */
+                printf("Resuming game saved in %s\n", maze_save_file);
+        }
+        start_gtk(&argc, &argv, maze_run_to_completion_cb, 240);
+        maze_game_free(maze_gtk_game);
+        return 0;
+}
+#endif
+
+#ifdef MAZE_BENCHMARK
+/* Headless level generation benchmark.  Drives the MAZE_LEVEL_INIT/MAZE_BUILD
+ * states to completion in a tight loop for a range of seeds instead of one
+ * state per timer tick, and reports throughput.
+ *
+ * Usage: maze-bench [--profile] [number-of-seeds] [first-seed] [xdim] [ydim]
+ *        maze-bench [--profile] --replay session-recorded-with-maze--record...
+ *        maze-bench [--profile] --sessions number-of-sessions [threads] [presses-per-session]
+ *        maze-bench --ir-badges number-of-badges [packets-per-sec] [packets-per-badge]
+ */
+#define MAZE_LEGACY_STACK_SIZE 50 /* the old fixed stack, which restarted the level on overflow */
+
+/* Plays back one recorded session as fast as possible and prints where it ended
+ * up, so two runs (or two builds) can be compared.  Returns 0, or 2 if the game
+ * asked for a different input than the log has next.
+ */
+static int maze_replay_session(const char *filename)
+{
+    struct maze_game *game;
+    long long states = 0;
+    struct timeval start, end;
+    double elapsed;
+
+    if (maze_replay_open(filename) != 0) {
+        fprintf(stderr, "%s: not a recorded session\n", filename);
+        return 1;
+    }
+    game = maze_game_new(); /* after maze_replay_open(), which sets the dimensions */
+    if (!game) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        return 1;
+    }
+    gettimeofday(&start, NULL);
+    while (game->state != MAZE_EXIT && !maze_replay_diverged) {
+        if (maze_replay_next == -1 &&
+            (game->state == MAZE_PROCESS_COMMANDS || game->state == MAZE_GAME_INIT))
+            break;
+        /* Waiting for a button, but the log says the next thing is a new game */
+        if (maze_replay_next == MAZE_INPUT_SEED && game->state == MAZE_PROCESS_COMMANDS)
+            maze_replay_diverged = 1;
+        else
+            maze_game_cb(game);
+        states++;
+    }
+    if (maze_replay_next != -1)
+        maze_replay_diverged = 1;
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (elapsed <= 0.0)
+        elapsed = 0.000001;
+
+    printf("%s: %d events, %lld states in %.3f seconds (recorded over %.1f seconds)%s\n",
+            filename, maze_replay_events, states, elapsed,
+            maze_replay_msecs / 1000.0, maze_replay_diverged ? " DIVERGED" : "");
+    printf("%s: level %d, player at %d,%d, hp %d, gp %d, rng %08x\n",
+            filename, game->current_level, game->player.x, game->player.y, game->player.hitpoints, game->player.gp,
+            game->xorshift_state);
+    maze_game_free(game);
+    return maze_replay_diverged ? 2 : 0;
+}
+
+/* Replays each session in a child process, so every one starts from the same
+ * state a new maze process would, and a crash only takes out that session.
+ */
+static int maze_replay_sessions(int nfiles, char *files[])
+{
+    int i, status, diverged = 0, failed = 0;
+    struct timeval start, end;
+    double elapsed;
+    pid_t pid;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nfiles; i++) {
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0)
+            exit(maze_replay_session(files[i]));
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+            printf("%s: replay crashed\n", files[i]);
+            failed++;
+        } else if (WEXITSTATUS(status) == 2) {
+            diverged++;
+        } else if (WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (elapsed <= 0.0)
+        elapsed = 0.000001;
+
+    printf("%d sessions replayed in %.3f seconds: %.1f sessions/sec, %d diverged, %d failed\n",
+            nfiles, elapsed, nfiles / elapsed, diverged, failed);
+    return diverged || failed;
+}
+
+/* A player for maze-bench --sessions, who presses buttons at random whenever
+ * the game is waiting for one, until they have pressed enough.
+ */
+struct maze_bench_player {
+    unsigned int rng;
+    int presses_left;
+};
+
+static int maze_bench_player_idle(void *data)
+{
+    static const unsigned char button[] = {
+        MAZE_INPUT_UP, MAZE_INPUT_UP, MAZE_INPUT_UP, MAZE_INPUT_UP, MAZE_INPUT_LEFT,
+        MAZE_INPUT_LEFT, MAZE_INPUT_RIGHT, MAZE_INPUT_RIGHT, MAZE_INPUT_BUTTON, MAZE_INPUT_DOWN,
+    };
+    struct maze_bench_player *p = data;
+
+    if (p->presses_left <= 0)
+        return -1;
+    p->presses_left--;
+    return button[xorshift(&p->rng) % ARRAYSIZE(button)];
+}
+
+/* Plays many games at once with the scheduler, each with its own random player,
+ * until every player has stopped pressing buttons.  The digest depends only on
+ * where each game ended up, so it should not change with the number of threads.
+ */
+static int maze_sched_bench(int argc, char *argv[])
+{
+    int i, nsessions, nthreads, presses, exited = 0;
+    long long pressed = 0;
+    unsigned long long steps = 0, steals = 0;
+    unsigned int digest = 0;
+    struct maze_game **game;
+    struct maze_bench_player *player;
+    struct maze_sched *sched;
+    struct timeval start, end;
+    double elapsed;
+
+    nsessions = argc > 0 ? atoi(argv[0]) : 0;
+    nthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    presses = argc > 2 ? atoi(argv[2]) : 200;
+    if (nsessions <= 0 || nthreads <= 0) {
+        fprintf(stderr, "usage: maze-bench --sessions number-of-sessions [threads] [presses-per-session]\n");
+        return 1;
+    }
+    game = calloc(nsessions, sizeof(*game));
+    player = calloc(nsessions, sizeof(*player));
+    sched = maze_sched_new(nthreads, maze_bench_player_idle);
+    if (!game || !player || !sched)
+        goto out_of_memory;
+    for (i = 0; i < nsessions; i++) {
+        game[i] = maze_game_new();
+        if (!game[i])
+            goto out_of_memory;
+        player[i].rng = i + 1;
+        player[i].presses_left = presses;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nsessions; i++)
+        if (!maze_sched_add(sched, game[i], i + 1, &player[i]))
+            goto out_of_memory;
+    maze_sched_wait_idle(sched);
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (elapsed <= 0.0)
+        elapsed = 0.000001;
+
+    for (i = 0; i < sched->nworkers; i++) {
+        steps += sched->worker[i].steps;
+        steals += sched->worker[i].steals;
+    }
+    for (i = 0; i < nsessions; i++) {
+        pressed += presses - player[i].presses_left;
+        if (game[i]->session->state == MAZE_SESSION_DONE)
+            exited++;
+        digest = digest * 31 + game[i]->current_level;
+        digest = digest * 31 + (game[i]->player.x << 8 | game[i]->player.y);
+        digest = digest * 31 + (game[i]->player.hitpoints << 8 | game[i]->player.gp);
+        digest = digest * 31 + game[i]->xorshift_state;
+    }
+    printf("%d sessions on %d threads in %.3f seconds: %.0f states/sec, %.0f presses/sec\n",
+            nsessions, sched->nworkers, elapsed, steps / elapsed, pressed / elapsed);
+    printf("%llu states, %lld presses, %llu sessions stolen, %d players quit, digest %08x\n",
+            steps, pressed, steals, exited, digest);
+    for (i = 0; i < sched->nworkers; i++)
+        printf("  thread %d: %llu states, %llu steals\n", i, sched->worker[i].steps, sched->worker[i].steals);
+    maze_sched_free(sched);
+    for (i = 0; i < nsessions; i++)
+        maze_game_free(game[i]);
+    free(game);
+    free(player);
+    return 0;
+
+out_of_memory:
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+}
+
+/* One of maze_ir_bench()'s badges, and what it has received */
+struct maze_ir_bench_badge {
+    struct ir_badge *badge;
+    unsigned int id;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int woken, stop;
+    /* Only changed by the badge's thread, read atomically by any */
+    unsigned long received, fifo_received, fifo_out_of_order;
+};
+
+#define MAZE_IR_BENCH_QUEUE 1024 /* a sender waits while this many are queued, rather than drop them */
+#define MAZE_IR_FIFO_MARK 0xf1f00000U /* the top 12 bits of packets written to the fifo */
+#define MAZE_IR_FIFO_PACKETS 10000
+
+static int maze_ir_bench_packets;
+static unsigned int maze_ir_bench_fifo_packet[MAZE_IR_FIFO_PACKETS];
+static __thread struct maze_ir_bench_badge *maze_ir_bench_this;
+
+static void maze_ir_bench_wake(void *cookie)
+{
+    struct maze_ir_bench_badge *b = cookie;
+
+    pthread_mutex_lock(&b->lock);
+    b->woken = 1;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void maze_ir_bench_receive(struct IRpacket_t p)
+{
+    struct maze_ir_bench_badge *b = maze_ir_bench_this;
+
+    if ((p.v & 0xfff00000U) != MAZE_IR_FIFO_MARK) {
+        __atomic_store_n(&b->received, b->received + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (p.v != (MAZE_IR_FIFO_MARK | b->fifo_received))
+        __atomic_store_n(&b->fifo_out_of_order, b->fifo_out_of_order + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->fifo_received, b->fifo_received + 1, __ATOMIC_RELAXED);
+}
+
+/* Sends maze_ir_bench_packets packets, all different, so none are coalesced,
+ * then receives until told to stop.
+ */
+static void *maze_ir_bench_thread(void *arg)
+{
+    struct maze_ir_bench_badge *b = arg;
+    union IRpacket_u p;
+    struct ir_stats stats;
+    int i, stop;
+
+    maze_ir_bench_this = b;
+    ir_badge_select(b->badge);
+    register_ir_packet_callback(maze_ir_bench_receive);
+    for (i = 0; i < maze_ir_bench_packets; i++) {
+        for (;;) {
+            ir_badge_deliver(b->badge);
+            ir_badge_stats(b->badge, &stats);
+            if (stats.queued < MAZE_IR_BENCH_QUEUE)
+                break;
+            usleep(100);
+        }
+        p.v = b->id << 16 | (i & 0xffff);
+        IRqueueSend(p);
+    }
+    do {
+        pthread_mutex_lock(&b->lock);
+        while (!b->woken && !b->stop)
+            pthread_cond_wait(&b->cond, &b->lock);
+        b->woken = 0;
+        stop = b->stop;
+        pthread_mutex_unlock(&b->lock);
+        ir_badge_deliver(b->badge);
+    } while (!stop);
+    return NULL;
+}
+
+/* Whether every badge has sent everything, and received or lost everything
+ * the others sent, and the first badge everything written to its fifo.
+ */
+static int maze_ir_bench_done(struct maze_ir_bench_badge *badge, int nbadges, unsigned long *sent)
+{
+    struct ir_stats stats;
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < nbadges; i++) {
+        ir_badge_stats(badge[i].badge, &stats);
+        if (stats.queued || stats.sent + stats.coalesced + stats.dropped != (unsigned long) maze_ir_bench_packets)
+            return 0;
+        sent[i] = stats.sent;
+        total += stats.sent;
+    }
+    for (i = 0; i < nbadges; i++) {
+        ir_badge_stats(badge[i].badge, &stats);
+        if (__atomic_load_n(&badge[i].received, __ATOMIC_RELAXED) + stats.lost != total - sent[i])
+            return 0;
+    }
+    return __atomic_load_n(&badge[0].fifo_received, __ATOMIC_RELAXED) == MAZE_IR_FIFO_PACKETS;
+}
+
+/* Floods the IR transport with simulated badges, each on a thread of its own,
+ * all sending to one another, optionally at a limited rate.  The first badge
+ * also gets packets through a fifo, written a few bytes at a time so that
+ * most of them are split across reads.  Checks that every packet sent was
+ * received or counted as lost, that the fifo's arrived whole and in order,
+ * and that no badge sent faster than its rate, and reports packets per second.
+ */
+static int maze_ir_bench(int argc, char *argv[])
+{
+    int i, nbadges, fd, ok = 1;
+    unsigned int rate;
+    unsigned long *sent, received = 0;
+    struct maze_ir_bench_badge *badge;
+    struct ir_stats stats, total = { 0 };
+    pthread_t *thr;
+    char fifo[64];
+    size_t off;
+    ssize_t n;
+    struct timeval start, end;
+    double elapsed, limit, fastest = 0.0;
+
+    nbadges = argc > 0 ? atoi(argv[0]) : 0;
+    rate = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    maze_ir_bench_packets = argc > 2 ? atoi(argv[2]) : rate ? 2 * rate : 20000;
+    if (nbadges < 2 || maze_ir_bench_packets <= 0) {
+        fprintf(stderr, "usage: maze-bench --ir-badges number-of-badges (at least 2) [packets-per-sec] [packets-per-badge]\n");
+        return 1;
+    }
+    badge = calloc(nbadges, sizeof(*badge));
+    thr = calloc(nbadges, sizeof(*thr));
+    sent = calloc(nbadges, sizeof(*sent));
+    if (!badge || !thr || !sent)
+        goto out_of_memory;
+    snprintf(fifo, sizeof(fifo), "/tmp/maze-bench-ir.%d", (int) getpid());
+    for (i = 0; i < nbadges; i++) {
+        badge[i].id = 0x0100 + i;
+        pthread_mutex_init(&badge[i].lock, NULL);
+        pthread_cond_init(&badge[i].cond, NULL);
+        badge[i].badge = ir_badge_new(badge[i].id, i ? NULL : fifo, maze_ir_bench_wake, &badge[i]);
+        if (!badge[i].badge)
+            goto out_of_memory;
+        ir_badge_set_send_rate(badge[i].badge, rate);
+    }
+    fd = open(fifo, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", fifo, strerror(errno));
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nbadges; i++)
+        if (pthread_create(&thr[i], NULL, maze_ir_bench_thread, &badge[i]) != 0) {
+            fprintf(stderr, "Failed to create badge thread\n");
+            return 1;
+        }
+    /* 7 bytes at a time, so that nearly every packet is split across two reads */
+    for (i = 0; i < MAZE_IR_FIFO_PACKETS; i++)
+        maze_ir_bench_fifo_packet[i] = MAZE_IR_FIFO_MARK | i;
+    for (off = 0; off < sizeof(maze_ir_bench_fifo_packet); off += n) {
+        n = sizeof(maze_ir_bench_fifo_packet) - off < 7 ? sizeof(maze_ir_bench_fifo_packet) - off : 7;
+        n = write(fd, (unsigned char *) maze_ir_bench_fifo_packet + off, n);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        if (n < 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", fifo, strerror(errno));
+            return 1;
+        }
+    }
+    close(fd);
+    limit = 30.0 + (rate ? (double) maze_ir_bench_packets / rate : 0.0);
+    do {
+        usleep(1000);
+        gettimeofday(&end, NULL);
+        elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+        if (elapsed > limit) {
+            fprintf(stderr, "Packets still missing after %.0f seconds\n", limit);
+            ok = 0;
+            break;
+        }
+    } while (!maze_ir_bench_done(badge, nbadges, sent));
+    for (i = 0; i < nbadges; i++) {
+        pthread_mutex_lock(&badge[i].lock);
+        badge[i].stop = 1;
+        pthread_cond_signal(&badge[i].cond);
+        pthread_mutex_unlock(&badge[i].lock);
+        pthread_join(thr[i], NULL);
+    }
+    unlink(fifo);
+
+    for (i = 0; i < nbadges; i++) {
+        ir_badge_stats(badge[i].badge, &stats);
+        total.sent += stats.sent;
+        total.coalesced += stats.coalesced;
+        total.dropped += stats.dropped;
+        total.lost += stats.lost;
+        received += badge[i].received;
+        if (stats.sent / elapsed > fastest)
+            fastest = stats.sent / elapsed;
+    }
+    printf("%d badges, %d packets each, in %.3f seconds: %.0f packets/sec sent, %.0f packets/sec received\n",
+            nbadges, maze_ir_bench_packets, elapsed, total.sent / elapsed, (received + badge[0].fifo_received) / elapsed);
+    printf("sent %lu, coalesced %lu, dropped %lu, received %lu, lost %lu, fifo %lu of %d, %lu out of order\n",
+            total.sent, total.coalesced, total.dropped, received, total.lost,
+            badge[0].fifo_received, MAZE_IR_FIFO_PACKETS, badge[0].fifo_out_of_order);
+    if (badge[0].fifo_out_of_order) {
+        fprintf(stderr, "Packets written to the fifo arrived out of order or damaged\n");
+        ok = 0;
+    }
+    if (rate) {
+        /* Each badge may send a burst on top of its rate */
+        printf("fastest badge %.0f packets/sec, limit %u\n", fastest, rate);
+        if (fastest > rate * 1.1 + 8 / elapsed) {
+            fprintf(stderr, "A badge sent faster than its rate\n");
+            ok = 0;
+        }
+    }
+    free(badge);
+    free(thr);
+    free(sent);
+    return ok ? 0 : 1;
+
+out_of_memory:
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, nseeds = 1000, max_depth = 0, legacy_restarts = 0;
+    unsigned int first_seed = 1;
+    long long steps = 0;
+    struct timeval start, end;
+    double elapsed;
+    struct maze_game *game;
+
+    if (argc > 1 && strcmp(argv[1], "--profile") == 0) {
+        maze_profile_start();
+        argc--;
+        argv++;
+    }
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0)
+        return maze_replay_sessions(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--sessions") == 0)
+        return maze_sched_bench(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--ir-badges") == 0)
+        return maze_ir_bench(argc - 2, argv + 2);
+    if (argc > 1)
+        nseeds = atoi(argv[1]);
+    if (argc > 2)
+        first_seed = strtoul(argv[2], NULL, 0);
+    if (argc > 3)
+        maze_set_dimensions(atoi(argv[3]), argc > 4 ? atoi(argv[4]) : atoi(argv[3]));
+    if (nseeds <= 0) {
+        fprintf(stderr, "usage: %s [number-of-seeds] [first-seed] [xdim] [ydim]\n", argv[0]);
+        return 1;
+    }
+    game = maze_game_new();
+    if (!game) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nseeds; i++) {
+        game->current_level = i % NLEVELS; /* exercise ladder and chalice placement too */
+        game->previous_level = -1;
+        game->random_seed[game->current_level] = first_seed + i;
+        game->state = MAZE_LEVEL_INIT;
+        do {
+            if (game->state == MAZE_BUILD)
+                steps++;
+            maze_game_cb(game);
+            if (max_depth < game->gen.max_stack_depth)
+                max_depth = game->gen.max_stack_depth;
+        } while (game->state == MAZE_LEVEL_INIT || game->state == MAZE_BUILD);
+        /* A fixed stack of the old size would have overflowed and thrown this level away */
+        if (game->max_stack_depth >= MAZE_LEGACY_STACK_SIZE)
+            legacy_restarts++;
+    }
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (elapsed <= 0.0)
+        elapsed = 0.000001;
+
+    printf("%d levels (%dx%d) in %.3f seconds: %.1f levels/sec\n",
+            nseeds, maze_xdim, maze_ydim, elapsed, nseeds / elapsed);
+    printf("%lld generation steps: %.0f steps/sec\n", steps, steps / elapsed);
+    printf("restarts: %d maze too small, %d stack entries dropped\n",
+            game->gen.too_small_restarts, game->gen.dropped_stack_entries);
+    printf("max stack depth: %d of %d\n", max_depth, game->gen.stack_size);
+    printf("stack overflow restarts saved vs. a %d entry stack: %d (%.1f per 1000 seeds)\n",
+            MAZE_LEGACY_STACK_SIZE, legacy_restarts, legacy_restarts * 1000.0 / nseeds);
+    maze_game_free(game);
+    return 0;
 }
 #endif